@@ -11,6 +11,15 @@
 #include <linux/kobject.h> 
 #include <linux/sysfs.h> 
 #include<linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/llist.h>
+#include <linux/list.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
 #include "lib/ioctl.h"
 
 MODULE_LICENSE("GPL");
@@ -21,18 +30,30 @@ MODULE_AUTHOR("Daniele Ferrarelli");
 
 static int hlm_open(struct inode *, struct file *);
 static int hlm_release(struct inode *, struct file *);
-static ssize_t hlm_write(struct file *, const char *, size_t, loff_t *);
-static ssize_t hlm_read(struct file *filp, char *buff, size_t len, loff_t *off);
+static ssize_t hlm_write(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t hlm_read(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t ring_write(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t ring_read(struct kiocb *iocb, struct iov_iter *to, int prt);
+static __poll_t hlm_poll(struct file *filp, poll_table *wait);
+static int hlm_mmap(struct file *filp, struct vm_area_struct *vma);
+static ssize_t hlm_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
 
 int major_number;
 module_param(major_number,int,0660);
 
+//Capacity and block size of the flows of all the devices at load time
 unsigned long max_bytes = 500;
 module_param(max_bytes,ulong,0660);
 
 int block_max_size = 50;
 module_param(block_max_size,int,0660);
 
+//Storage engine used by the devices at load time
+#define BACKEND_LIST 0
+#define BACKEND_RING 1
+int backend = BACKEND_LIST;
+module_param(backend,int,0660);
+
 #define DEVICE_NAME "hlm"  /* Device file name in /dev/ - not mandatory  */
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
@@ -44,16 +65,49 @@ module_param(block_max_size,int,0660);
 #endif
 
 static int Major;            /* Major number assigned to broadcast device driver */
-struct workqueue_struct *wq;	// Workqueue for async add
 
 #define MINORS 128
 
-//Linked list node
+//Maximum number of priority levels of a device, also the number of lockdep subclasses
+#define FLOWS 8
+
+//Maximum number of messages in a single SEND_BATCH or RECV_BATCH
+#define BATCH_MAX 64
+
+//Maximum number of records claimed together by a reader of a consumer group
+#define GROUP_BATCH 8
+
+//First busy poll window in microseconds when waits turn out to be short
+#define BUSY_POLL_START 10
+
+//Linked list node, the payload is stored right after the header
 struct element {
 	struct element *next;
+	//Links the messages pushed by lockless writers
+	struct llist_node llnode;
 	int len;
-	char *data;
-} list_node;
+	//Capacity of the payload area
+	int size;
+	//Index of the cache the block comes from, -1 if kmalloc'd
+	int cls;
+	//Length of the record starting in this block, 0 if the block continues a record
+	int rec;
+	//Number of broadcast cursors positioned in this block
+	int refs;
+	//Time of the write of the newest bytes in the block, used by the ttl of the device
+	ktime_t stamp;
+	char data[];
+};
+
+//Payload size classes of the block caches
+static const int block_classes[] = {16, 32, 64, 128, 256, 512, 1024, 2048};
+static const char *block_cache_names[] = {"hlm_block_16", "hlm_block_32", "hlm_block_64", "hlm_block_128",
+	"hlm_block_256", "hlm_block_512", "hlm_block_1024", "hlm_block_2048"};
+#define BLOCK_CLASSES ARRAY_SIZE(block_classes)
+//Largest block size of a flow, every block of a write comes from a cache
+#define BLOCK_SIZE_MAX (block_classes[BLOCK_CLASSES - 1])
+
+static struct kmem_cache *block_cache[BLOCK_CLASSES];
 
 //Structs that stores a series of nodes
 struct fragmented_data {
@@ -61,49 +115,182 @@ struct fragmented_data {
 	struct element *tail;
 };
 
-struct work_data {
-    struct work_struct work;
-    int minor;
-    int len;
-    struct fragmented_data *data;
+//Contiguous byte ring that stores a flow with the ring backend
+struct ring {
+	char *buf;
+	unsigned long size;
+	//Index of the first byte to read
+	unsigned long r;
+	//Index where the next byte is written
+	unsigned long w;
 };
 
 
+
+//Token bucket of a rate limit, tokens are bytes. A write is allowed while there are
+//tokens and takes the bytes it wrote, so a big write leaves the bucket in debt
+struct bucket {
+	//Bytes per second, 0 if there is no limit
+	unsigned long rate;
+	//Maximum number of tokens, 0 for a second of rate
+	unsigned long burst;
+	long tokens;
+	//Time the tokens were last accounted to
+	ktime_t last;
+};
+
+struct _object_state;
+
+//Wait queue of a flow with the bytes that the running wake up can hand out
+struct flow_queue {
+	wait_queue_head_t wq;
+	unsigned long budget;
+	//Flow of the queue, used to hand out again the bytes of a waiter that leaves
+	struct _object_state *obj;
+	int prt;
+	int writers;
+};
+
 //Struct that stores the state of the device
 typedef struct _object_state{
-	//Current priority
+	//Default priority of the files opened on the device
 	int priority;
+	//Number of priority levels of the device, level 0 is deferred
+	int levels;
+	//How reads choose their flow, READ_FLOW, READ_STRICT or READ_WRR
+	int read_mode;
+	//Reads served by every level in a round of weighted round robin
+	int weight[FLOWS];
+	//Level served by weighted round robin and the reads it has left in the round
+	int rr_level;
+	int rr_left;
+	spinlock_t rr_lock;
 	//Number of thread sleeping
-	int asleep[2];
-	//Current timeout
+	int asleep[FLOWS];
+	//Default timeout of the files opened on the device, in microseconds
 	unsigned long timeout;
-	//If reading/writing can block
+	//Default busy poll window of the files opened on the device, in microseconds
+	unsigned long busy_poll;
+	//If reading/writing can block by default
 	int block;
 	//Current read position in the head block
-	int r_pos[2];
+	int r_pos[FLOWS];
 	//If the object is enabled
 	int enabled;
 	//Stores the kernel object that displays statistics
 	struct kobject *kobj;
 	//Number of valid bytes in the system
-	unsigned long valid[2];
+	unsigned long valid[FLOWS];
+	//Maximum number of bytes stored in every flow, and size of the blocks of its writes
+	unsigned long max_bytes[FLOWS];
+	int block_size[FLOWS];
 	//Number of bytes pending write in the work queue
 	unsigned long pending;
-	//Stores the head of the 2 flows
-	struct element *head[2];
-	//Stores the tail of the 2 flows
-	struct element *tail[2];
-	//Single thraed work queue for every device
+	//Low priority messages waiting for the work item of the device
+	struct llist_head lo_list;
+	//Work item that commits the pending low priority messages
+	struct work_struct lo_work;
+	//Microseconds the low priority writes are collected before the commit, 0 to commit
+	//right away, and pending bytes that commit before the end of the window, 0 for no limit
+	unsigned long flush_interval;
+	unsigned long flush_bytes;
+	//Timer of the window started by the first pending write
+	struct hrtimer flush_timer;
+	//Number of commits of the pending low priority bytes
+	unsigned long commits;
+	//Time to live in milliseconds of the low priority data, 0 if it never expires
+	unsigned long ttl;
+	//Delayed work that drops the expired low priority data when nobody uses the flow
+	struct delayed_work reap_work;
+	//Bytes of low priority data dropped because expired
+	unsigned long expired;
+	//Rate limits of the writes to the whole device and to every flow
+	struct bucket dev_bucket;
+	struct bucket bucket[FLOWS];
+	spinlock_t bucket_lock;
+	//Writes of every flow that found no tokens
+	atomic_long_t throttled[FLOWS];
+	//Stores the head of the flows
+	struct element *head[FLOWS];
+	//Stores the tail of the flows
+	struct element *tail[FLOWS];
+	//Bytes stored and capacity of the blocks in the flows
+	unsigned long block_bytes[FLOWS];
+	unsigned long block_space[FLOWS];
+	//If the writers of the synchronous flows push their blocks without taking the lock
+	int lockless;
+	//Messages pushed by lockless writers of every flow, moved in the flow by readers
+	struct llist_head hi_list[FLOWS];
+	//Number of bytes in hi_list
+	atomic_long_t hi_pushed[FLOWS];
+	//Storage engine of the flows, list of blocks or contiguous ring
+	int backend;
+	//If every write is a record returned whole by a single read
+	int datagram;
+	//If a write that doesn't fit stores the bytes that fit and returns a short count
+	int partial;
+	//If every open file reads all the data with its own cursor
+	int broadcast;
+	//Sequence number of the first byte stored in the flows, used by broadcast cursors
+	unsigned long base[FLOWS];
+	//Open files of the device, changed with the locks of all the flows held
+	struct list_head subscribers;
+	//If the readers claim whole records in batches, each record goes to a single reader
+	int group;
+	//Bytes of the records claimed by the readers of the group and not read yet
+	atomic_long_t claimed[FLOWS];
+	//Rings of the flows, allocated only with the ring backend
+	struct ring ring[FLOWS];
+	//Rings shared with user space, allocated by the first mmap
+	struct hlm_shm *shm;
+	unsigned long shm_size;
+	//Serializes the creation of the shared rings, taken under mmap_lock and never held
+	//across a copy to or from user space
+	struct mutex shm_lock;
+	//Single thraed work queue for every device, runs the deferred low priority work
 	struct workqueue_struct *work_queue;
 	//Lock used for syncronization, 1 for each priority
-	struct mutex mux_lock[2];
-	//Wait queues for writing and reading threads
-	wait_queue_head_t wq_w;
-	wait_queue_head_t wq_r;
+	struct mutex mux_lock[FLOWS];
+	//Wait queues for writing and reading threads, 1 for each priority
+	struct flow_queue wq_w[FLOWS];
+	struct flow_queue wq_r[FLOWS];
+	//Number of allocations done by writers and of messages delivered
+	atomic_long_t allocs;
+	atomic_long_t messages;
 } object_state;
 
 object_state objects[MINORS];
 
+//Reading position of an open file in a flow of a broadcast device. The block is NULL
+//when the position has to be found again from the head of the flow
+struct cursor {
+	struct element *block;
+	int pos;
+	//Sequence number of the next byte to read
+	unsigned long seq;
+	//Set by the first read, only the cursors of files that read hold the data back
+	int active;
+};
+
+//State of an open file, stored in its private_data and set up by hlm_open
+struct subscriber {
+	struct list_head node;
+	//Serializes the reads done with the same file
+	struct mutex lock;
+	struct cursor cur[FLOWS];
+	//Records claimed from the flows in consumer group mode
+	struct fragmented_data stash[FLOWS];
+	//Settings of the session, the ones of the device are only the defaults of new files
+	int priority;
+	int block;
+	unsigned long timeout;
+	unsigned long busy_poll;
+	//Current busy poll window, adapted to how long the waits of the file last
+	unsigned long poll_window;
+	//If the file mapped the shared rings, poll reports their readiness instead of the flows
+	int mapped;
+};
+
 int minimum(int a, int b) {
 	if(a < b) {
 		return a;
@@ -112,313 +299,2814 @@ int minimum(int a, int b) {
 	}
 }
 
+//Take the locks of all the flows, always in the same order
+void lock_flows(object_state *obj) {
+	for(int j = 0; j < FLOWS; j++) {
+		mutex_lock_nested(&(obj->mux_lock[j]), j);
+	}
+}
+
+void unlock_flows(object_state *obj) {
+	for(int j = FLOWS - 1; j >= 0; j--) {
+		mutex_unlock(&(obj->mux_lock[j]));
+	}
+}
+
+//Thread sleeping on a flow until demand bytes of data or space are available
+struct flow_waiter {
+	wait_queue_entry_t wait;
+	unsigned long demand;
+	struct flow_queue *queue;
+	//Set when a wake up gave demand bytes of its budget to the waiter
+	int handed;
+};
+
+//Wake function of the flow waiters, only the waiters whose demand fits in the budget of
+//the queue are woken. The key is left to poll waiters sharing the queue
+static int flow_wake_function(wait_queue_entry_t *wait, unsigned mode, int sync, void *key) {
+	struct flow_waiter *waiter = container_of(wait, struct flow_waiter, wait);
+	unsigned long *budget = &(waiter->queue->budget);
+
+	if(*budget != ULONG_MAX) {
+		//Already woken, it will recheck its condition anyway
+		if((wait->flags & WQ_FLAG_WOKEN) || waiter->handed) {
+			return 0;
+		}
+
+		if(waiter->demand > *budget) {
+			return 0;
+		}
+
+		*budget -= waiter->demand;
+		waiter->handed = waiter->demand > 0;
+	}
+
+	return woken_wake_function(wait, mode, sync, key);
+}
+
+//Sleep as wait_woken does until the absolute deadline, the hrtimer gives the timeouts a
+//microsecond resolution. Returns 0 if the deadline expired
+int wait_woken_until(wait_queue_entry_t *wait, ktime_t deadline) {
+	int ret = 1;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	if(!(wait->flags & WQ_FLAG_WOKEN)) {
+		//No slack, the timer slack of the task would be coarser than the timeout
+		ret = schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS) != 0;
+	}
+	__set_current_state(TASK_RUNNING);
+	smp_store_mb(wait->flags, wait->flags & ~WQ_FLAG_WOKEN);
+
+	return ret;
+}
+
+//Adapt the busy poll window after a wait that slept, like haltpoll the window grows when
+//the wait ended within the busy poll limit and shrinks when it lasted longer
+void adapt_poll(struct subscriber *sub, s64 waited) {
+	unsigned long limit = READ_ONCE(sub->busy_poll);
+	unsigned long window = READ_ONCE(sub->poll_window);
+
+	if(limit == 0) {
+		return;
+	}
+
+	if(waited <= limit) {
+		window = window ? minimum(window * 2, limit) : minimum(BUSY_POLL_START, limit);
+	} else {
+		window /= 2;
+	}
+
+	WRITE_ONCE(sub->poll_window, window);
+}
+
+//Spin for the busy poll window of the session, without going past the deadline of the
+//wait. Spins on the lockless hint, condition may take the lock of the flow and is
+//checked only when the hint says it can be true. Stops as soon as the cpu is needed or
+//a signal arrives
+#define busy_poll(sub, hint, condition, deadline)				\
+({										\
+	int __hit = 0;								\
+	unsigned long __window = READ_ONCE((sub)->poll_window);			\
+	ktime_t __end = ktime_add_us(ktime_get(), __window);			\
+										\
+	if(ktime_after(__end, (deadline))) {					\
+		__end = (deadline);						\
+	}									\
+										\
+	while(__window > 0) {							\
+		if((hint) && (condition)) {					\
+			__hit = 1;						\
+			break;							\
+		}								\
+		if(need_resched() || signal_pending(current) ||			\
+			!ktime_before(ktime_get(), __end)) {			\
+			break;							\
+		}								\
+		cpu_relax();							\
+	}									\
+										\
+	__hit;									\
+})
+
+//Sleep on fq until condition is true, the thread is woken only when need bytes can be
+//served. The timeout and the busy poll window are the ones of the session sub, hint is
+//the lockless check spun on by the busy poll. A waiter that was handed bytes and doesn't
+//use them, because they are gone, it times out or it is interrupted, passes the wake up on.
+//Returns 1 if the condition is true, 0 on timeout and -ERESTARTSYS if interrupted
+#define wait_flow(fq, need, hint, condition, sub)				\
+({										\
+	struct flow_waiter __waiter;						\
+	ktime_t __start = ktime_get();						\
+	ktime_t __deadline = ktime_add_us(__start, (sub)->timeout);		\
+	long __ret = 1;								\
+										\
+	if(!busy_poll(sub, hint, condition, __deadline)) {			\
+		init_waitqueue_func_entry(&__waiter.wait, flow_wake_function);	\
+		__waiter.wait.private = current;				\
+		__waiter.demand = (need);					\
+		__waiter.queue = (fq);						\
+		__waiter.handed = 0;						\
+		add_wait_queue_exclusive(&(fq)->wq, &__waiter.wait);		\
+										\
+		for(;;) {							\
+			if(condition) {						\
+				__ret = 1;					\
+				break;						\
+			}							\
+			if(__waiter.handed) {					\
+				pass_wakeup(fq);				\
+				spin_lock_irq(&(fq)->wq.lock);			\
+				__waiter.handed = 0;				\
+				spin_unlock_irq(&(fq)->wq.lock);		\
+				continue;					\
+			}							\
+			if(__ret == 0) {					\
+				break;						\
+			}							\
+			if(signal_pending(current)) {				\
+				__ret = -ERESTARTSYS;				\
+				break;						\
+			}							\
+			__ret = wait_woken_until(&__waiter.wait, __deadline);	\
+		}								\
+										\
+		remove_wait_queue(&(fq)->wq, &__waiter.wait);			\
+		if(__ret != 1 && __waiter.handed) {				\
+			pass_wakeup(fq);					\
+		}								\
+		adapt_poll(sub, ktime_us_delta(ktime_get(), __start));		\
+	}									\
+										\
+	__ret;									\
+})
+
+//Wake the threads sleeping on a queue, at most budget bytes are handed out to flow
+//waiters while poll waiters are always woken
+void wake_flow(struct flow_queue *fq, unsigned long budget) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&(fq->wq.lock), flags);
+	fq->budget = budget;
+	__wake_up_locked(&(fq->wq), TASK_INTERRUPTIBLE, 0);
+	fq->budget = ULONG_MAX;
+	spin_unlock_irqrestore(&(fq->wq.lock), flags);
+}
+
+void init_flow_queue(struct flow_queue *fq, struct _object_state *obj, int prt, int writers) {
+	init_waitqueue_head(&(fq->wq));
+	fq->budget = ULONG_MAX;
+	fq->obj = obj;
+	fq->prt = prt;
+	fq->writers = writers;
+}
+
+//Wake the readers of a flow that can be served with the bytes now available
+void wake_readers(object_state *obj, int prt) {
+	unsigned long budget;
+
+	if(!wq_has_sleeper(&(obj->wq_r[prt].wq))) {
+		return;
+	}
+
+	//Broadcast readers don't consume the data, all of them are woken
+	if(obj->broadcast) {
+		wake_flow(&(obj->wq_r[prt]), ULONG_MAX);
+		return;
+	}
+
+	budget = READ_ONCE(obj->valid[prt]);
+	if(prt) {
+		budget += atomic_long_read(&obj->hi_pushed[prt]);
+	}
+
+	wake_flow(&(obj->wq_r[prt]), budget);
+}
+
+//Allocate a block able to store len bytes from the smallest fitting cache
+struct element *alloc_block(int len) {
+	struct element *node;
+	int i;
+
+	for(i = 0; i < BLOCK_CLASSES; i++) {
+		if(len <= block_classes[i]) {
+			break;
+		}
+	}
+
+	if(i < BLOCK_CLASSES) {
+		node = kmem_cache_alloc(block_cache[i], GFP_KERNEL);
+		if(node == NULL) {
+			return NULL;
+		}
+
+		node->size = block_classes[i];
+		node->cls = i;
+	} else {
+		//Blocks bigger than the biggest class fall back to kmalloc
+		node = kmalloc(sizeof(struct element) + len, GFP_KERNEL);
+		if(node == NULL) {
+			return NULL;
+		}
+
+		node->size = len;
+		node->cls = -1;
+	}
+
+	node->next = NULL;
+	node->len = 0;
+	node->rec = 0;
+	node->refs = 0;
+
+	return node;
+}
+
+void free_block(struct element *node) {
+	if(node->cls < 0) {
+		kfree(node);
+	} else {
+		kmem_cache_free(block_cache[node->cls], node);
+	}
+}
+
+void destroy_block_caches(void) {
+	for(int i = 0; i < BLOCK_CLASSES; i++) {
+		if(block_cache[i] != NULL) {
+			kmem_cache_destroy(block_cache[i]);
+			block_cache[i] = NULL;
+		}
+	}
+}
+
+int create_block_caches(void) {
+	for(int i = 0; i < BLOCK_CLASSES; i++) {
+		block_cache[i] = kmem_cache_create(block_cache_names[i], sizeof(struct element) + block_classes[i], 0, SLAB_HWCACHE_ALIGN, NULL);
+		if(block_cache[i] == NULL) {
+			destroy_block_caches();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 //Function that add a series of nodes to the queue
 void enqueue(object_state *obj, int ptr, struct fragmented_data *data) {
 	struct element **head;
 	struct element **tail; 
+	struct element *node;
+	int spare;
+	int x;
 
 	head = &(obj->head[ptr]);
 	tail = &(obj->tail[ptr]);
 
+	for(node = data->head; node != NULL; node = node->next) {
+		obj->block_bytes[ptr] += node->len;
+	}
+
 	if(*head == NULL) {
 		//If the queue was empty reset reading position
 		*head = data->head;
 		*tail = data->tail;
 		obj->r_pos[ptr] = 0;
 	} else {
-		(*tail)->next = data->head;
+		//Fill the spare space of the tail block before linking new blocks,
+		//records always start at the beginning of a block
+		spare = obj->datagram ? 0 : minimum((*tail)->size, obj->block_size[ptr]) - (*tail)->len;
+		node = data->head;
+		while(node != NULL && spare > 0) {
+			x = minimum(spare, node->len);
+			memcpy((*tail)->data + (*tail)->len, node->data, x);
+			(*tail)->len += x;
+			(*tail)->stamp = node->stamp;
+			spare -= x;
+
+			if(x < node->len) {
+				//Keep the rest of the node at the start of its block
+				memmove(node->data, node->data + x, node->len - x);
+				node->len -= x;
+				break;
+			}
+
+			data->head = node->next;
+			free_block(node);
+			node = data->head;
+		}
+
+		if(node == NULL) {
+			return;
+		}
+
+		(*tail)->next = node;
 		*tail = data->tail;
 	}
+
+	for(node = data->head; node != NULL; node = node->next) {
+		obj->block_space[ptr] += node->size;
+	}
 }
 
-//Function that is called to do the delayed work
-static void work_handler(struct work_struct *work_elem){
-	int timeout;
-	int len;
-	struct work_data *wd = container_of((void*)work_elem,struct work_data, work);
-	int minor = wd->minor;
-	
-	object_state *obj = objects + minor;
+//Move the messages of a lockless list at the end of a flow, called with the lock
+//of the flow held. Returns the number of bytes moved
+long splice_list(object_state *obj, int prt, struct llist_head *list) {
+	struct llist_node *first;
+	struct element *node;
+	struct fragmented_data data;
+	long bytes;
 
-	timeout = obj->timeout;
+	bytes = 0;
 
-	//Lenght of the fragmented data
-	len = wd->len;
+	//The list is in push order reversed
+	first = llist_reverse_order(llist_del_all(list));
+	while(first != NULL) {
+		data.head = llist_entry(first, struct element, llnode);
+		//The head block can be freed by enqueue
+		first = first->next;
 
-	//Critical section
-	mutex_lock(&(obj->mux_lock[0]));
+		for(node = data.head; node != NULL; node = node->next) {
+			bytes += node->len;
+			data.tail = node;
+		}
 
-	//Update valid and pending blocks
-	obj->valid[0] += len;
-	obj->pending -= len;
-	enqueue(obj, 0, wd->data);
+		enqueue(obj, prt, &data);
+	}
 
-	mutex_unlock(&(obj->mux_lock[0]));
-	wake_up(&(obj->wq_r));
+	return bytes;
+}
+
+//Make readable all the bytes written in a shared ring, returns if something changed
+int shm_commit(struct hlm_shm_flow *flow) {
+	unsigned long long head = smp_load_acquire(&(flow->head));
 
-	kfree(wd->data);
-	kfree(work_elem);
-    return;
+	if(head == READ_ONCE(flow->commit)) {
+		return 0;
+	}
+
+	smp_store_release(&(flow->commit), head);
+	return 1;
 }
 
-int space_occupied(object_state *obj, int prt) {
-	if(prt) return obj->valid[prt];
-	else return obj->valid[prt] + obj->pending;
+unsigned long bucket_size(struct bucket *b) {
+	return b->burst ? b->burst : b->rate;
 }
 
-// Function that checks if there is enough space to write
-int can_write(object_state *obj, int prt, int len) {
-	mutex_lock(&(obj->mux_lock[prt]));
-	
-	if(space_occupied(obj, prt) + len <= max_bytes) return 1;
+//Add the tokens earned since the last refill, the time of the bytes not yet earned is kept
+void refill(struct bucket *b, ktime_t now) {
+	u64 earned;
 
-	mutex_unlock(&(obj->mux_lock[prt]));
-	return 0;
+	earned = mul_u64_u64_div_u64(ktime_to_ns(ktime_sub(now, b->last)), b->rate, NSEC_PER_SEC);
+	if(b->tokens + (long)earned >= (long)bucket_size(b)) {
+		b->tokens = bucket_size(b);
+		b->last = now;
+	} else {
+		b->tokens += earned;
+		b->last = ktime_add_ns(b->last, mul_u64_u64_div_u64(earned, NSEC_PER_SEC, b->rate));
+	}
 }
 
-// Function that frees the queue
-void free_queue(struct element *head) {
-	struct element *curr = head;
-	struct element *tmp;
-
-	while(curr != NULL) {
-		tmp = curr->next;
-		kfree(curr->data);
-		kfree(curr);
+//Nanoseconds before a bucket has tokens again, 0 if it has
+s64 bucket_delay(struct bucket *b, ktime_t now) {
+	if(b->rate == 0) {
+		return 0;
+	}
 
-		curr = tmp;
+	refill(b, now);
+	if(b->tokens > 0) {
+		return 0;
 	}
+
+	return ktime_to_ns(ktime_sub(ktime_add_ns(b->last, mul_u64_u64_div_u64(1 - b->tokens, NSEC_PER_SEC, b->rate)), now));
 }
 
+//Nanoseconds before a write on a flow is allowed by the limits of the device and of the flow
+s64 throttle_delay(object_state *obj, int prt) {
+	s64 delay;
+	ktime_t now;
 
-static ssize_t hlm_write(struct file *filp, const char *buff, size_t len, loff_t *off) {
-	int ret;
-	int prt;
-	int timeout;
-	int block;
-	int min;
-	int to_write;
-	struct work_data * data;
-	struct fragmented_data * frag_data;
-	struct element **head;
-	struct element **tail; 
-	struct element *node;
+	if(READ_ONCE(obj->dev_bucket.rate) == 0 && READ_ONCE(obj->bucket[prt].rate) == 0) {
+		return 0;
+	}
 
-	int minor = get_minor(filp);
-	object_state *obj = objects + minor;
+	now = ktime_get();
+	spin_lock(&(obj->bucket_lock));
+	delay = max(bucket_delay(&(obj->dev_bucket), now), bucket_delay(&(obj->bucket[prt]), now));
+	spin_unlock(&(obj->bucket_lock));
 
-	prt = obj->priority;
-	head = &(obj->head[prt]);
-	tail = &(obj->tail[prt]);
-	timeout = obj->timeout;
-	block = obj->block;
+	return delay;
+}
 
-	if(len > max_bytes) {
-		return -ENOSPC;
+//Wait for the tokens of a write on the flow of the session. Blocking writers sleep on the
+//write queue until the buckets refill or the limits change.
+//Returns 0, -EAGAIN for non blocking writers, -ETIMEDOUT or -ERESTARTSYS
+int throttle(object_state *obj, struct subscriber *sub, int prt) {
+	int ret;
+	s64 delay;
+	ktime_t wake;
+	ktime_t deadline;
+	struct flow_waiter waiter;
+
+	delay = throttle_delay(obj, prt);
+	if(delay <= 0) {
+		return 0;
 	}
-	
-	to_write = len;
 
-	//Fragment data and store in the fragmented_data struct
-	frag_data = kmalloc(sizeof(struct fragmented_data), GFP_KERNEL);
-	if(frag_data == NULL) {
-		return -ENOMEM;
+	atomic_long_inc(&obj->throttled[prt]);
+	if(!sub->block) {
+		return -EAGAIN;
 	}
 
-	frag_data->head = NULL;
-	while(to_write > 0) {
-		//Find the lenght of the block to write
-		min = minimum(to_write, block_max_size);
-		node = kmalloc(sizeof(struct element), GFP_KERNEL);
-		if(node == NULL) {
-			free_queue(frag_data->head);
-			kfree(frag_data);
-			return -ENOMEM;
+	deadline = ktime_add_us(ktime_get(), sub->timeout);
+
+	//Tokens don't take space, any wake up of the queue can let the writer check again
+	init_waitqueue_func_entry(&waiter.wait, flow_wake_function);
+	waiter.wait.private = current;
+	waiter.demand = 0;
+	waiter.queue = &(obj->wq_w[prt]);
+	add_wait_queue(&(obj->wq_w[prt].wq), &waiter.wait);
+	atomic_inc((atomic_t*)&(obj->asleep[prt]));
+
+	ret = 0;
+	while(delay > 0) {
+		wake = ktime_add_ns(ktime_get(), delay);
+		if(!ktime_before(ktime_get(), deadline)) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		if(signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
 		}
 
-		node->next = NULL;
-		node->len = min;
-		node->data = kmalloc(min, GFP_KERNEL);
-		if(node->data == NULL) {
-			free_queue(frag_data->head);
-			kfree(frag_data);
-			kfree(node);
-			return -ENOMEM;
+		wait_woken_until(&waiter.wait, ktime_before(wake, deadline) ? wake : deadline);
+		delay = throttle_delay(obj, prt);
+	}
+
+	atomic_dec((atomic_t*)&(obj->asleep[prt]));
+	remove_wait_queue(&(obj->wq_w[prt].wq), &waiter.wait);
+
+	return ret;
+}
+
+//Take from the buckets of the device and of the flow the bytes written
+void charge(object_state *obj, int prt, long bytes) {
+	if(READ_ONCE(obj->dev_bucket.rate) == 0 && READ_ONCE(obj->bucket[prt].rate) == 0) {
+		return;
+	}
+
+	spin_lock(&(obj->bucket_lock));
+	if(obj->dev_bucket.rate) {
+		obj->dev_bucket.tokens -= bytes;
+	}
+	if(obj->bucket[prt].rate) {
+		obj->bucket[prt].tokens -= bytes;
+	}
+	spin_unlock(&(obj->bucket_lock));
+}
+
+//Drop the blocks of the low priority flow older than the ttl of the device, called with
+//the lock of the flow held. A block read by a broadcast cursor stops the expiry, the
+//reaper is armed for the next block to expire. Returns the number of bytes dropped
+long expire_flow(object_state *obj) {
+	int bytes;
+	long dropped;
+	ktime_t now;
+	ktime_t limit;
+	struct element *node;
+	struct subscriber *sub;
+
+	if(obj->ttl == 0 || obj->head[0] == NULL) {
+		return 0;
+	}
+
+	now = ktime_get();
+	limit = ktime_sub(now, ms_to_ktime(obj->ttl));
+
+	dropped = 0;
+	node = obj->head[0];
+	while(node != NULL && node->refs == 0 && !ktime_after(node->stamp, limit)) {
+		//Bytes before the reading position were already read
+		bytes = node->len - obj->r_pos[0];
+		obj->head[0] = node->next;
+		obj->base[0] += node->len;
+		obj->valid[0] -= bytes;
+		obj->block_bytes[0] -= node->len;
+		obj->block_space[0] -= node->size;
+		obj->r_pos[0] = 0;
+		dropped += bytes;
+
+		free_block(node);
+		node = obj->head[0];
+	}
+
+	obj->expired += dropped;
+
+	//Broadcast cursors waiting for dropped bytes continue from the oldest one left
+	list_for_each_entry(sub, &obj->subscribers, node) {
+		if(sub->cur[0].block == NULL && sub->cur[0].seq < obj->base[0]) {
+			sub->cur[0].seq = obj->base[0];
 		}
+	}
 
-		ret += copy_from_user(node->data, buff + (len - to_write), min);
-		if(ret != 0) {
-			node->len -= ret;
-			to_write = 0;
-		} else {
-			to_write -= min;
+	//The rest of the flow expires later, a block kept by a cursor is dropped at its next read
+	if(node != NULL && node->refs == 0) {
+		queue_delayed_work(obj->work_queue, &obj->reap_work,
+			nsecs_to_jiffies(ktime_to_ns(ktime_sub(node->stamp, limit))) + 1);
+	}
+
+	return dropped;
+}
+
+//End of the window of the pending low priority writes
+static enum hrtimer_restart flush_timer_handler(struct hrtimer *timer) {
+	object_state *obj = container_of(timer, object_state, flush_timer);
+
+	queue_work(obj->work_queue, &obj->lo_work);
+
+	return HRTIMER_NORESTART;
+}
+
+//Schedule the commit of the pending low priority bytes, called with the lock of the flow
+//held after first tells if the write is the first one pending. With a flush interval the
+//writes are committed together when the window of the first one ends, or as soon as
+//flush_bytes are pending
+void schedule_commit(object_state *obj, int first) {
+	if(obj->flush_interval == 0) {
+		if(first) {
+			queue_work(obj->work_queue, &obj->lo_work);
 		}
+		return;
+	}
 
-		if(frag_data->head == NULL) {
-			frag_data->head = node;
-			frag_data->tail = node;
-		} else {
-			frag_data->tail->next = node;
-			frag_data->tail = node;
+	if(obj->flush_bytes && obj->pending >= obj->flush_bytes) {
+		queue_work(obj->work_queue, &obj->lo_work);
+	} else if(first) {
+		hrtimer_start(&obj->flush_timer, us_to_ktime(obj->flush_interval), HRTIMER_MODE_REL);
+	}
+}
+
+//Claimed records still take space in the flow until they are read
+int space_occupied(object_state *obj, int prt) {
+	if(prt) return obj->valid[prt] + atomic_long_read(&obj->hi_pushed[prt]) + atomic_long_read(&obj->claimed[prt]);
+	else return obj->valid[prt] + obj->pending + atomic_long_read(&obj->claimed[prt]);
+}
+
+//Reserve space for len bytes in a synchronous flow without taking the lock
+int reserve_pushed(object_state *obj, int prt, long len) {
+	long pushed;
+
+	do {
+		pushed = atomic_long_read(&obj->hi_pushed[prt]);
+		//Readers move bytes in valid before removing them from hi_pushed
+		smp_rmb();
+		if(READ_ONCE(obj->valid[prt]) + atomic_long_read(&obj->claimed[prt]) + pushed + len > READ_ONCE(obj->max_bytes[prt])) {
+			return 0;
 		}
+	} while(atomic_long_cmpxchg(&obj->hi_pushed[prt], pushed, pushed + len) != pushed);
+
+	return 1;
+}
+
+//Move the messages pushed by lockless writers at the end of a synchronous flow,
+//called with the lock of the flow held
+void drain_pushed(object_state *obj, int prt) {
+	long bytes;
+
+	if(llist_empty(&obj->hi_list[prt])) {
+		return;
 	}
 
-	if(block) {
-		atomic_inc((atomic_t*)&(obj->asleep[prt]));
-		wait_event_interruptible_timeout(obj->wq_w, can_write(obj, prt, len), timeout);
-		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+	bytes = splice_list(obj, prt, &obj->hi_list[prt]);
+	obj->valid[prt] += bytes;
+	smp_wmb();
+	atomic_long_sub(bytes, &obj->hi_pushed[prt]);
+}
+
+//Bring a flow up to date before using it, called with the lock of the flow held. The
+//messages of lockless writers are moved in the synchronous flows, the expired data is
+//dropped from the low priority one
+void refresh_flow(object_state *obj, int prt) {
+	if(prt) {
+		drain_pushed(obj, prt);
+	} else {
+		expire_flow(obj);
+	}
+}
+
+//Maximum number of bytes that a flow can store
+unsigned long flow_capacity(object_state *obj, int prt) {
+	if(obj->backend == BACKEND_RING) return obj->ring[prt].size;
+	else return READ_ONCE(obj->max_bytes[prt]);
+}
+
+//Bytes that can still be written in a flow, without the lock it is only a hint
+unsigned long flow_room(object_state *obj, int prt) {
+	unsigned long occupied = space_occupied(obj, prt);
+	unsigned long capacity = flow_capacity(obj, prt);
+
+	return occupied < capacity ? capacity - occupied : 0;
+}
+
+//Bytes that a file can read from a flow without waiting
+unsigned long flow_readable(object_state *obj, struct subscriber *sub, int prt) {
+	unsigned long readable;
+
+	readable = READ_ONCE(obj->valid[prt]);
+	if(obj->broadcast && READ_ONCE(sub->cur[prt].active)) {
+		//Only the bytes after the cursor of the file are readable
+		readable += READ_ONCE(obj->base[prt]);
+		readable -= READ_ONCE(sub->cur[prt].seq);
+	}
+	if(prt) {
+		readable += atomic_long_read(&obj->hi_pushed[prt]);
+	}
+	if(obj->group && READ_ONCE(sub->stash[prt].head) != NULL) {
+		//Records claimed by the file
+		readable++;
+	}
+
+	return readable;
+}
+
+//Wake the writers of a flow whose messages fit in the space now free
+void wake_writers(object_state *obj, int prt) {
+	unsigned long budget;
+	unsigned long occupied;
+
+	if(!wq_has_sleeper(&(obj->wq_w[prt].wq))) {
+		return;
+	}
+
+	occupied = space_occupied(obj, prt);
+	if(occupied >= flow_capacity(obj, prt)) {
+		return;
+	}
+
+	budget = flow_capacity(obj, prt) - occupied;
+	wake_flow(&(obj->wq_w[prt]), budget);
+}
+
+//Hand out again the bytes now available in the flow of a queue
+void pass_wakeup(struct flow_queue *fq) {
+	if(fq->writers) {
+		wake_writers(fq->obj, fq->prt);
+	} else {
+		wake_readers(fq->obj, fq->prt);
+	}
+}
+
+//Function that is called to do the delayed work, commits all the pending messages at once
+static void work_handler(struct work_struct *work_elem){
+	long len;
+	long dropped;
+	object_state *obj = container_of(work_elem, object_state, lo_work);
+
+	//The window ends with this commit, later writes start a new one
+	hrtimer_try_to_cancel(&obj->flush_timer);
+
+	//Critical section
+	mutex_lock(&(obj->mux_lock[0]));
+
+	if(obj->backend == BACKEND_RING) {
+		//With the ring backend the bytes are already in place
+		len = obj->pending;
+	} else {
+		len = splice_list(obj, 0, &obj->lo_list);
+	}
+
+	//Update valid and pending blocks
+	obj->valid[0] += len;
+	obj->pending -= len;
+	if(len) {
+		obj->commits++;
+	}
+
+	//Arms the reaper for the data just committed, expired bytes make room for the writers
+	dropped = expire_flow(obj);
+
+	mutex_unlock(&(obj->mux_lock[0]));
+
+	//Commit the bytes written by user space in the low priority shared ring
+	if(obj->shm != NULL && shm_commit(&(obj->shm->flow[0]))) {
+		len = 1;
+	}
+
+	if(len) {
+		wake_readers(obj, 0);
+	}
+
+	if(dropped) {
+		wake_writers(obj, 0);
+	}
+}
+
+//Delayed work that drops the expired low priority data while no thread uses the flow
+static void reap_handler(struct work_struct *work_elem) {
+	long dropped;
+	object_state *obj = container_of(to_delayed_work(work_elem), object_state, reap_work);
+
+	mutex_lock(&(obj->mux_lock[0]));
+	dropped = expire_flow(obj);
+	mutex_unlock(&(obj->mux_lock[0]));
+
+	if(dropped) {
+		wake_writers(obj, 0);
+	}
+}
+
+// Function that checks if there is enough space to write
+int can_write(object_state *obj, int prt, int len) {
+	mutex_lock(&(obj->mux_lock[prt]));
+	refresh_flow(obj, prt);
+	
+	if(space_occupied(obj, prt) + len <= flow_capacity(obj, prt)) return 1;
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	return 0;
+}
+
+// Function that frees the queue
+void free_queue(struct element *head) {
+	struct element *curr = head;
+	struct element *tmp;
+
+	while(curr != NULL) {
+		tmp = curr->next;
+		free_block(curr);
+
+		curr = tmp;
+	}
+}
+
+//Keep only the first keep bytes of a series of nodes, at least 1, the rest is freed
+void trim_fragments(struct fragmented_data *data, int keep) {
+	struct element *node;
+	int kept;
+
+	kept = 0;
+	node = data->head;
+	while(kept + node->len < keep) {
+		kept += node->len;
+		node = node->next;
+	}
+
+	node->len = keep - kept;
+	free_queue(node->next);
+	node->next = NULL;
+	data->tail = node;
+	data->head->rec = keep;
+}
+
+
+//Copy len bytes of the iterator in blocks of the block size of the flow. Returns the number
+//of bytes that could not be copied from the user, or -ENOMEM
+int fragment(object_state *obj, int prt, struct iov_iter *from, int len, struct fragmented_data *frag_data) {
+	int ret;
+	int min;
+	int to_write;
+	int allocs;
+	int size;
+	ktime_t now;
+	struct element *node;
+
+	to_write = len;
+	ret = 0;
+	allocs = 0;
+	now = ktime_get();
+	size = READ_ONCE(obj->block_size[prt]);
+
+	frag_data->head = NULL;
+	frag_data->tail = NULL;
+	while(to_write > 0) {
+		//Find the lenght of the block to write
+		min = minimum(to_write, size);
+		//Blocks have room for size bytes so that next writes can fill them, records are
+		//never topped up and only take the bytes they hold
+		node = alloc_block(obj->datagram ? min : size);
+		if(node == NULL) {
+			atomic_long_add(allocs, &obj->allocs);
+			free_queue(frag_data->head);
+			frag_data->head = NULL;
+			return -ENOMEM;
+		}
+		allocs++;
+
+		node->stamp = now;
+		node->len = min;
+		ret = min - copy_from_iter(node->data, min, from);
+		if(ret != 0) {
+			//Bytes of this block and of the following ones are not written
+			node->len -= ret;
+			ret = to_write - node->len;
+			to_write = 0;
+		} else {
+			to_write -= min;
+		}
+
+		if(node->len == 0) {
+			free_block(node);
+			break;
+		}
+
+		if(frag_data->head == NULL) {
+			frag_data->head = node;
+			frag_data->tail = node;
+		} else {
+			frag_data->tail->next = node;
+			frag_data->tail = node;
+		}
+	}
+
+	atomic_long_add(allocs, &obj->allocs);
+
+	return ret;
+}
+
+//Write the whole iterator as a single message, every segment is accounted under one lock
+static ssize_t hlm_write(struct kiocb *iocb, struct iov_iter *from) {
+	int ret;
+	int prt;
+	int block;
+	int reserved;
+	long waited;
+	unsigned long room;
+	unsigned long need;
+	struct fragmented_data frag_data;
+	struct element **head;
+	struct element **tail; 
+
+	struct file *filp = iocb->ki_filp;
+	size_t len = iov_iter_count(from);
+	int minor = get_minor(filp);
+	object_state *obj = objects + minor;
+	struct subscriber *sub = filp->private_data;
+
+	prt = sub->priority;
+	head = &(obj->head[prt]);
+	tail = &(obj->tail[prt]);
+	block = sub->block;
+
+	//Writes of both backends wait for the tokens of the rate limits
+	ret = throttle(obj, sub, prt);
+	if(ret != 0) {
+		return ret;
+	}
+
+	if(obj->backend == BACKEND_RING) {
+		return ring_write(iocb, from);
+	}
+
+	//Writes that can't be stored are rejected before the blocks are allocated and copied,
+	//a partial write copies only the bytes that fit
+	room = flow_room(obj, prt);
+	if(obj->partial) {
+		if(room == 0 && block) {
+			atomic_inc((atomic_t*)&(obj->asleep[prt]));
+			waited = wait_flow(&(obj->wq_w[prt]), 1, 1, flow_room(obj, prt) > 0, sub);
+			atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+			if(waited <= 0) {
+				return -ENOSPC;
+			}
+			room = flow_room(obj, prt);
+		}
+
+		if(room == 0) {
+			return -ENOSPC;
+		}
+
+		if(len > room) {
+			len = room;
+		}
+	} else if(len > flow_capacity(obj, prt) || (!block && len > room)) {
+		return -ENOSPC;
+	}
+	
+	//Fragment data and store in the fragmented_data struct
+	ret = fragment(obj, prt, from, len, &frag_data);
+	if(ret < 0) {
+		return ret;
+	}
+
+	if(frag_data.head == NULL) {
+		//Nothing was copied from the user
+		return len ? -EFAULT : 0;
+	}
+
+	if(obj->datagram && ret != 0) {
+		//A record is never stored in part
+		free_queue(frag_data.head);
+		return -EFAULT;
+	}
+	frag_data.head->rec = len - ret;
+
+	if(prt && obj->lockless) {
+		if(block) {
+			atomic_inc((atomic_t*)&(obj->asleep[prt]));
+			reserved = wait_flow(&(obj->wq_w[prt]), len - ret, 1, reserve_pushed(obj, prt, len - ret), sub) > 0;
+			atomic_dec((atomic_t*)&(obj->asleep[prt]));
+		} else {
+			reserved = reserve_pushed(obj, prt, len - ret);
+		}
+
+		//The flow filled up after the copy, a partial write takes the space left
+		room = flow_room(obj, prt);
+		if(!reserved && obj->partial && room > 0 && room < len - ret) {
+			trim_fragments(&frag_data, room);
+			ret = len - room;
+			reserved = reserve_pushed(obj, prt, room);
+		}
+
+		if(!reserved) {
+			free_queue(frag_data.head);
+			return -ENOSPC;
+		}
+
+		llist_add(&frag_data.head->llnode, &obj->hi_list[prt]);
+		atomic_long_inc(&obj->messages);
+		charge(obj, prt, len - ret);
+
+		wake_readers(obj, prt);
+
+		return len - ret;
+	}
+
+	if(block) {
+		//A partial write goes on as soon as some of its bytes fit
+		need = obj->partial ? 1 : len - ret;
+		atomic_inc((atomic_t*)&(obj->asleep[prt]));
+		waited = wait_flow(&(obj->wq_w[prt]), need, flow_room(obj, prt) >= need, can_write(obj, prt, need), sub);
+		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+		//The lock is held only if the condition was met
+		if(waited <= 0) {
+			free_queue(frag_data.head);
+			return -ENOSPC;
+		}
+	} else {
+		mutex_lock(&(obj->mux_lock[prt]));
+		refresh_flow(obj, prt);
+	}
+
+	if(space_occupied(obj, prt) + (len - ret) > flow_capacity(obj, prt)) {
+		room = flow_room(obj, prt);
+		if(!obj->partial || room == 0) {
+			mutex_unlock(&(obj->mux_lock[prt]));
+			free_queue(frag_data.head);
+			return -ENOSPC;
+		}
+
+		trim_fragments(&frag_data, room);
+		ret = len - room;
+	}
+
+	//The backend was switched while the blocks were prepared
+	if(obj->backend != BACKEND_LIST) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		free_queue(frag_data.head);
+		return -EBUSY;
+	}
+
+	if(prt) {
+		enqueue(obj, prt, &frag_data);
+		obj->valid[prt] += len - ret;
+	} else {
+		//The work item of the device commits all the pending messages together
+		obj->pending += len - ret;
+		schedule_commit(obj, llist_add(&frag_data.head->llnode, &obj->lo_list));
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	atomic_long_inc(&obj->messages);
+	charge(obj, prt, len - ret);
+
+	if(prt) {
+		wake_readers(obj, prt);
+	}
+
+	return len - ret;
+}
+
+//Check if a reader has enough data to read
+int can_read(object_state *obj, int to_read, loff_t *off, int prt) {
+	mutex_lock(&(obj->mux_lock[prt]));
+
+	refresh_flow(obj, prt);
+
+	if(to_read + *off <= obj->valid[prt]) {
+		return 1;
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	return 0;
+}
+
+//Copy len bytes from the user at the write index of the ring, returns the bytes copied
+unsigned long ring_copy_in(struct ring *ring, struct iov_iter *from, unsigned long len) {
+	unsigned long first;
+	unsigned long copied;
+
+	//More than the ring would wrap over bytes of the same copy
+	if(len > ring->size) {
+		return 0;
+	}
+
+	//Data wraps around the end of the ring in at most two segments
+	first = min_t(unsigned long, len, ring->size - ring->w);
+	copied = copy_from_iter(ring->buf + ring->w, first, from);
+
+	if(copied == first && len > first) {
+		copied += copy_from_iter(ring->buf, len - first, from);
+	}
+
+	ring->w = (ring->w + copied) % ring->size;
+
+	return copied;
+}
+
+//Copy len bytes to the user from the read index of the ring, returns the bytes copied
+unsigned long ring_copy_out(struct ring *ring, struct iov_iter *to, unsigned long len) {
+	unsigned long first;
+	unsigned long copied;
+
+	if(len > ring->size) {
+		return 0;
+	}
+
+	first = min_t(unsigned long, len, ring->size - ring->r);
+	copied = copy_to_iter(ring->buf + ring->r, first, to);
+
+	if(copied == first && len > first) {
+		copied += copy_to_iter(ring->buf, len - first, to);
+	}
+
+	ring->r = (ring->r + copied) % ring->size;
+
+	return copied;
+}
+
+static ssize_t ring_write(struct kiocb *iocb, struct iov_iter *from) {
+	int prt;
+	int block;
+	int ret;
+	unsigned long need;
+	unsigned long copied;
+	struct ring *ring;
+
+	struct file *filp = iocb->ki_filp;
+	size_t len = iov_iter_count(from);
+	int minor = get_minor(filp);
+	object_state *obj = objects + minor;
+	struct subscriber *sub = filp->private_data;
+
+	prt = sub->priority;
+	ring = &(obj->ring[prt]);
+	block = sub->block;
+
+	if(len == 0) {
+		return 0;
+	}
+
+	if(len > ring->size && !obj->partial) {
+		return -ENOSPC;
+	}
+
+	if(block) {
+		//A partial write goes on as soon as some of its bytes fit
+		need = obj->partial ? 1 : len;
+		atomic_inc((atomic_t*)&(obj->asleep[prt]));
+		ret = wait_flow(&(obj->wq_w[prt]), need, flow_room(obj, prt) >= need, can_write(obj, prt, need), sub);
+		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+		//The lock is held only if the condition was met
+		if(ret <= 0) {
+			return -ENOSPC;
+		}
+	} else {
+		mutex_lock(&(obj->mux_lock[prt]));
+	}
+
+	if(obj->backend != BACKEND_RING) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		return -EBUSY;
+	}
+
+	if(space_occupied(obj, prt) + len > ring->size) {
+		if(!obj->partial || flow_room(obj, prt) == 0) {
+			mutex_unlock(&(obj->mux_lock[prt]));
+			return -ENOSPC;
+		}
+
+		len = flow_room(obj, prt);
+	}
+
+	copied = ring_copy_in(ring, from, len);
+	if(copied == 0) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		return -EFAULT;
+	}
+
+	if(prt) {
+		obj->valid[prt] += copied;
+	} else {
+		//Deferred work only publishes the bytes already copied in the ring
+		obj->pending += copied;
+		schedule_commit(obj, obj->pending == copied);
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	atomic_long_inc(&obj->messages);
+	charge(obj, prt, copied);
+
+	if(prt) {
+		wake_readers(obj, prt);
+	}
+
+	return copied;
+}
+
+//Read from the ring of the flow chosen by hlm_read
+static ssize_t ring_read(struct kiocb *iocb, struct iov_iter *to, int prt) {
+	int block;
+	int ret;
+	unsigned long skip;
+	unsigned long copied;
+	struct ring *ring;
+	object_state *obj;
+	struct file *filp = iocb->ki_filp;
+	size_t len = iov_iter_count(to);
+	loff_t *off = &(iocb->ki_pos);
+	int minor = get_minor(filp);
+	struct subscriber *sub = filp->private_data;
+
+	obj = objects + minor;
+	ring = &(obj->ring[prt]);
+
+	block = sub->block;
+
+	if(*off < 0) {
+		return -1;
+	}
+
+	if(block) {
+		atomic_inc((atomic_t*)&(obj->asleep[prt]));
+		ret = wait_flow(&(obj->wq_r[prt]), len + *off, flow_readable(obj, sub, prt) >= len + *off, can_read(obj, len, off, prt), sub);
+		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+		//Even if there is not enough data, execute a partial read
+		if(ret <= 0) {
+			mutex_lock(&(obj->mux_lock[prt]));
+		}
+	} else {
+		mutex_lock(&(obj->mux_lock[prt]));
+	}
+
+	if(obj->backend != BACKEND_RING) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		return -EBUSY;
+	}
+
+	//Bytes before the offset are discarded, offset and length are clamped in 64 bits
+	skip = min_t(u64, *off, obj->valid[prt]);
+	ring->r = (ring->r + skip) % ring->size;
+	obj->valid[prt] -= skip;
+
+	copied = ring_copy_out(ring, to, min_t(size_t, len, obj->valid[prt]));
+	obj->valid[prt] -= copied;
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	wake_writers(obj, prt);
+
+	return copied;
+}
+
+//Check if a device stores no data, called with the locks of both flows held
+int flows_empty(object_state *obj) {
+	if(obj->pending || !llist_empty(&obj->lo_list)) {
+		return 0;
+	}
+
+	for(int j = 0; j < FLOWS; j++) {
+		if(obj->valid[j] || obj->head[j] || !llist_empty(&obj->hi_list[j]) || atomic_long_read(&obj->claimed[j])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//Change the storage engine of a device, allowed only when its flows are empty
+int set_backend(object_state *obj, int value) {
+	int ret = 0;
+
+	lock_flows(obj);
+
+	if(obj->backend == value) {
+		goto out;
+	}
+
+	if(!flows_empty(obj)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	//Records and cursors are kept only by the list backend
+	if(value == BACKEND_RING && (obj->datagram || obj->broadcast)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for(int j = 0; j < obj->levels; j++) {
+		struct ring *ring = &(obj->ring[j]);
+
+		if(value == BACKEND_RING) {
+			ring->buf = kvmalloc(obj->max_bytes[j], GFP_KERNEL);
+			if(ring->buf == NULL) {
+				for(int k = 0; k < j; k++) {
+					kvfree(obj->ring[k].buf);
+					obj->ring[k].buf = NULL;
+				}
+				ret = -ENOMEM;
+				goto out;
+			}
+			ring->size = obj->max_bytes[j];
+		} else {
+			kvfree(ring->buf);
+			ring->buf = NULL;
+			ring->size = 0;
+		}
+
+		ring->r = 0;
+		ring->w = 0;
+	}
+
+	obj->backend = value;
+
+out:
+	unlock_flows(obj);
+
+	return ret;
+}
+
+//Switch between byte stream and records, allowed only when the flows are empty since
+//the blocks of a stream don't carry the record lengths
+int set_datagram(object_state *obj, int value) {
+	int ret = 0;
+
+	lock_flows(obj);
+
+	if(obj->datagram == value) {
+		goto out;
+	}
+
+	if(!flows_empty(obj)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	//Consumer groups claim the records of the datagram mode, records are never written in part
+	if(obj->backend != BACKEND_LIST || obj->broadcast || obj->group || obj->partial) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	obj->datagram = value;
+
+out:
+	unlock_flows(obj);
+
+	return ret;
+}
+
+//Enable or disable partial writes, records of the datagram mode are always written whole
+int set_partial(object_state *obj, int value) {
+	int ret = 0;
+
+	lock_flows(obj);
+
+	if(value && obj->datagram) {
+		ret = -EINVAL;
+	} else {
+		obj->partial = value;
+	}
+
+	unlock_flows(obj);
+
+	return ret;
+}
+
+//Switch between consuming reads and broadcast, allowed only when the flows are empty.
+//All the open files start reading from the first byte written after the switch
+int set_broadcast(object_state *obj, int value) {
+	int ret = 0;
+	struct subscriber *sub;
+
+	lock_flows(obj);
+
+	if(obj->broadcast == value) {
+		goto out;
+	}
+
+	if(!flows_empty(obj)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if(obj->backend != BACKEND_LIST || obj->datagram) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for(int j = 0; j < FLOWS; j++) {
+		obj->base[j] = 0;
+		list_for_each_entry(sub, &obj->subscribers, node) {
+			sub->cur[j].block = NULL;
+			sub->cur[j].pos = 0;
+			sub->cur[j].seq = 0;
+			sub->cur[j].active = 0;
+		}
+	}
+
+	obj->broadcast = value;
+
+out:
+	unlock_flows(obj);
+
+	return ret;
+}
+
+//Enable or disable the consumer group, readers claim the records of the datagram mode.
+//Disabling is allowed only when no reader has records left to read
+int set_group(object_state *obj, int value) {
+	int ret = 0;
+
+	lock_flows(obj);
+
+	if(obj->group == value) {
+		goto out;
+	}
+
+	if(value && !obj->datagram) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for(int j = 0; j < FLOWS; j++) {
+		if(atomic_long_read(&obj->claimed[j])) {
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+
+	obj->group = value;
+
+out:
+	unlock_flows(obj);
+
+	return ret;
+}
+
+//Change the number of priority levels, allowed only when the flows are empty.
+//The rings of the ring backend are allocated for the current levels
+int set_levels(object_state *obj, int value) {
+	int ret = 0;
+	struct subscriber *sub;
+
+	lock_flows(obj);
+
+	if(obj->levels == value) {
+		goto out;
+	}
+
+	if(!flows_empty(obj)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if(obj->backend != BACKEND_LIST) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	obj->levels = value;
+	if(obj->priority >= value) {
+		obj->priority = value - 1;
+	}
+	list_for_each_entry(sub, &obj->subscribers, node) {
+		if(sub->priority >= value) {
+			sub->priority = value - 1;
+		}
+	}
+
+	spin_lock(&(obj->rr_lock));
+	obj->rr_level = value - 1;
+	obj->rr_left = obj->weight[value - 1];
+	spin_unlock(&(obj->rr_lock));
+
+out:
+	unlock_flows(obj);
+
+	return ret;
+}
+
+//Change the time to live of the low priority data, the data already stored is checked
+//again by the reaper right away
+void set_ttl(object_state *obj, unsigned long value) {
+	mutex_lock(&(obj->mux_lock[0]));
+	obj->ttl = value;
+	mutex_unlock(&(obj->mux_lock[0]));
+
+	mod_delayed_work(obj->work_queue, &obj->reap_work, 0);
+}
+
+//Change the window or the byte threshold of the commit of low priority writes, the
+//writes already pending are committed right away
+void set_flush(object_state *obj, int bytes, unsigned long value) {
+	mutex_lock(&(obj->mux_lock[0]));
+	if(bytes) {
+		obj->flush_bytes = value;
+	} else {
+		obj->flush_interval = value;
+	}
+	mutex_unlock(&(obj->mux_lock[0]));
+
+	queue_work(obj->work_queue, &obj->lo_work);
+}
+
+//Move the used bytes of a ring in a new buffer of size bytes, starting from index 0
+int resize_ring(struct ring *ring, unsigned long size, unsigned long used) {
+	char *buf;
+	unsigned long first;
+
+	if(used > size) {
+		return -EBUSY;
+	}
+
+	buf = kvmalloc(size, GFP_KERNEL);
+	if(buf == NULL) {
+		return -ENOMEM;
+	}
+
+	first = minimum(used, ring->size - ring->r);
+	memcpy(buf, ring->buf + ring->r, first);
+	memcpy(buf + first, ring->buf, used - first);
+
+	kvfree(ring->buf);
+	ring->buf = buf;
+	ring->size = size;
+	ring->r = 0;
+	ring->w = used % size;
+
+	return 0;
+}
+
+//Change the capacity of a flow keeping the data already stored. A list can shrink below
+//its data, writers wait until enough is read. A ring is moved in a buffer of the new size,
+//that must hold the bytes stored. Sleeping writers are woken when the flow grows
+int set_capacity(object_state *obj, int prt, unsigned long value) {
+	int ret = 0;
+
+	mutex_lock(&(obj->mux_lock[prt]));
+
+	if(obj->backend == BACKEND_RING && obj->ring[prt].buf != NULL) {
+		ret = resize_ring(&(obj->ring[prt]), value, space_occupied(obj, prt));
+	}
+
+	if(ret == 0) {
+		obj->max_bytes[prt] = value;
+
+		//A shared ring can't grow past the size it was allocated with
+		if(prt < 2 && obj->shm != NULL) {
+			WRITE_ONCE(obj->shm->flow[prt].capacity, min_t(unsigned long, value, obj->shm->flow[prt].size));
+		}
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+
+	if(ret == 0) {
+		wake_writers(obj, prt);
+	}
+
+	return ret;
+}
+
+//Change the size of the blocks of the next writes of a flow, stored blocks keep their size.
+//Sizes are limited to the largest cache, a small write still takes a whole block
+int set_block_size(object_state *obj, int prt, int value) {
+	if(value <= 0 || value > BLOCK_SIZE_MAX) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&(obj->mux_lock[prt]));
+	obj->block_size[prt] = value;
+	mutex_unlock(&(obj->mux_lock[prt]));
+
+	return 0;
+}
+
+//Change the rate or the burst of a limit, level is -1 for the limit of the whole device.
+//Sleeping writers are woken to wait again with the new limit
+void set_limit(object_state *obj, int level, int burst, unsigned long value) {
+	struct bucket *b;
+	unsigned long rate;
+	ktime_t now;
+
+	b = level < 0 ? &(obj->dev_bucket) : &(obj->bucket[level]);
+	now = ktime_get();
+
+	spin_lock(&(obj->bucket_lock));
+	rate = b->rate;
+	if(rate) {
+		refill(b, now);
+	}
+
+	if(burst) {
+		b->burst = value;
+	} else {
+		b->rate = value;
+	}
+
+	//A limit starts with a full bucket, a smaller one keeps only the tokens that fit
+	if(rate == 0 || b->tokens > (long)bucket_size(b)) {
+		b->tokens = bucket_size(b);
+	}
+	b->last = now;
+	spin_unlock(&(obj->bucket_lock));
+
+	for(int j = 0; j < FLOWS; j++) {
+		wake_flow(&(obj->wq_w[j]), ULONG_MAX);
+	}
+}
+
+//Move out of the flow the blocks that store the next to_take bytes, so that they can
+//be copied to the user without holding the lock. Returns the number of bytes detached
+int detach_blocks(object_state *obj, int prt, int to_take, struct fragmented_data *out, int *pos) {
+	struct element **head;
+	struct element *tmp;
+	int taken;
+	int lenght;
+
+	head = &(obj->head[prt]);
+	out->head = NULL;
+	out->tail = NULL;
+	//Reading position in the first detached block
+	*pos = obj->r_pos[prt];
+	taken = 0;
+
+	while(taken < to_take && *head != NULL) {
+		tmp = *head;
+		lenght = tmp->len - obj->r_pos[prt];
+
+		if(to_take - taken >= lenght) {
+			//The whole block is needed, unlink it
+			*head = tmp->next;
+			obj->block_bytes[prt] -= tmp->len;
+			obj->block_space[prt] -= tmp->size;
+			obj->r_pos[prt] = 0;
+		} else {
+			//Only the start of the block is needed, move it in a new block
+			lenght = to_take - taken;
+			tmp = alloc_block(lenght);
+			if(tmp == NULL) {
+				break;
+			}
+
+			memcpy(tmp->data, (*head)->data + obj->r_pos[prt], lenght);
+			tmp->len = lenght;
+			tmp->stamp = (*head)->stamp;
+			obj->r_pos[prt] += lenght;
+
+			if(out->head == NULL) {
+				*pos = 0;
+			}
+		}
+
+		taken += lenght;
+		tmp->next = NULL;
+		if(out->head == NULL) {
+			out->head = tmp;
+			out->tail = tmp;
+		} else {
+			out->tail->next = tmp;
+			out->tail = tmp;
+		}
+	}
+
+	obj->valid[prt] -= taken;
+
+	return taken;
+}
+
+//Put back at the head of the flow the blocks that could not be delivered
+void give_back(object_state *obj, int prt, struct element *node, int pos, struct element *last) {
+	struct element **head;
+	struct element *tmp;
+	int bytes;
+
+	head = &(obj->head[prt]);
+
+	//The undelivered bytes are moved at the start of the block
+	memmove(node->data, node->data + pos, node->len - pos);
+	node->len -= pos;
+
+	mutex_lock(&(obj->mux_lock[prt]));
+
+	bytes = 0;
+	for(tmp = node; tmp != NULL; tmp = tmp->next) {
+		bytes += tmp->len;
+		obj->block_space[prt] += tmp->size;
+	}
+
+	if(*head == NULL) {
+		obj->tail[prt] = last;
+	} else if(obj->r_pos[prt] != 0) {
+		//The reading position applies to the new head, drop the bytes already read from the old one
+		tmp = *head;
+		memmove(tmp->data, tmp->data + obj->r_pos[prt], tmp->len - obj->r_pos[prt]);
+		tmp->len -= obj->r_pos[prt];
+		obj->block_bytes[prt] -= obj->r_pos[prt];
+	}
+
+	last->next = *head;
+	*head = node;
+	obj->r_pos[prt] = 0;
+	obj->valid[prt] += bytes;
+	obj->block_bytes[prt] += bytes;
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	wake_readers(obj, prt);
+}
+
+//Copy the detached blocks to the iterator skipping the first skip bytes, the blocks that
+//could not be delivered go back in the flow. Returns the bytes copied or -EFAULT
+int deliver_blocks(object_state *obj, int prt, struct fragmented_data *detached, int pos, int skip, struct iov_iter *to) {
+	int ret;
+	int x;
+	int copied;
+	struct element *node;
+	struct element *tmp;
+
+	copied = 0;
+	ret = 0;
+	node = detached->head;
+	while(node != NULL) {
+		x = node->len - pos;
+
+		if(skip > 0) {
+			pos += minimum(skip, x);
+			skip -= minimum(skip, x);
+			x = node->len - pos;
+		}
+
+		if(x > 0) {
+			ret = x - copy_to_iter(node->data + pos, x, to);
+			copied += x - ret;
+			if(ret != 0) {
+				//Not all bytes were delivered, the rest goes back in the flow
+				pos += x - ret;
+				break;
+			}
+		}
+
+		tmp = node->next;
+		free_block(node);
+		node = tmp;
+		pos = 0;
+	}
+
+	if(node != NULL) {
+		give_back(obj, prt, node, pos, detached->tail);
+	}
+
+	if(ret != 0 && copied == 0) {
+		return -EFAULT;
+	}
+
+	return copied;
+}
+
+//Copy a whole detached record, the blocks are freed only if all the bytes are delivered.
+//Returns the length of the record or -EFAULT
+int copy_record(struct fragmented_data *record, struct iov_iter *to) {
+	int copied;
+	struct element *node;
+
+	copied = 0;
+	for(node = record->head; node != NULL; node = node->next) {
+		if(copy_to_iter(node->data, node->len, to) != node->len) {
+			return -EFAULT;
+		}
+		copied += node->len;
+	}
+
+	free_queue(record->head);
+
+	return copied;
+}
+
+//Read the record at the head of the flow, called with the lock of the flow held.
+//Returns the length of the record, or -EMSGSIZE if the buffer is too small for it
+ssize_t read_record(object_state *obj, int prt, struct iov_iter *to) {
+	int ret;
+	int pos;
+	struct fragmented_data record;
+
+	if(obj->head[prt] == NULL) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		return 0;
+	}
+
+	//The record stays in the flow for a read with a bigger buffer
+	if(obj->head[prt]->rec > iov_iter_count(to)) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		return -EMSGSIZE;
+	}
+
+	//Records start at the beginning of a block, so only whole blocks are detached
+	detach_blocks(obj, prt, obj->head[prt]->rec, &record, &pos);
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	wake_writers(obj, prt);
+
+	ret = copy_record(&record, to);
+	if(ret < 0) {
+		give_back(obj, prt, record.head, 0, record.tail);
+	}
+
+	return ret;
+}
+
+//Read a record claimed by the file. When the file has none, up to GROUP_BATCH records are
+//claimed with a single acquisition of the lock, so that the readers of a group rarely
+//contend on the flow. Returns the length of the record or -EMSGSIZE
+ssize_t group_read(object_state *obj, int prt, struct subscriber *sub, struct iov_iter *to) {
+	int ret;
+	int pos;
+	int bytes;
+	loff_t off;
+	struct fragmented_data *stash;
+	struct fragmented_data record;
+	struct element *node;
+
+	stash = &(sub->stash[prt]);
+
+	mutex_lock(&(sub->lock));
+
+	if(stash->head == NULL) {
+		off = 0;
+		if(sub->block) {
+			atomic_inc((atomic_t*)&(obj->asleep[prt]));
+			ret = wait_flow(&(obj->wq_r[prt]), 1, flow_readable(obj, sub, prt) >= 1, can_read(obj, 1, &off, prt), sub);
+			atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+			if(ret <= 0) {
+				mutex_lock(&(obj->mux_lock[prt]));
+			}
+		} else {
+			mutex_lock(&(obj->mux_lock[prt]));
+		}
+
+		if(!obj->group) {
+			mutex_unlock(&(obj->mux_lock[prt]));
+			mutex_unlock(&(sub->lock));
+			return -EBUSY;
+		}
+
+		refresh_flow(obj, prt);
+
+		bytes = 0;
+		for(int i = 0; i < GROUP_BATCH && obj->head[prt] != NULL; i++) {
+			bytes += detach_blocks(obj, prt, obj->head[prt]->rec, &record, &pos);
+
+			if(stash->head == NULL) {
+				*stash = record;
+			} else {
+				stash->tail->next = record.head;
+				stash->tail = record.tail;
+			}
+		}
+		atomic_long_add(bytes, &obj->claimed[prt]);
+
+		mutex_unlock(&(obj->mux_lock[prt]));
+
+		if(stash->head == NULL) {
+			mutex_unlock(&(sub->lock));
+			return 0;
+		}
+	}
+
+	//The record stays claimed for a read with a bigger buffer
+	if(stash->head->rec > iov_iter_count(to)) {
+		mutex_unlock(&(sub->lock));
+		return -EMSGSIZE;
+	}
+
+	//Unlink the blocks of the first record
+	record.head = stash->head;
+	node = stash->head;
+	bytes = node->len;
+	while(bytes < record.head->rec) {
+		node = node->next;
+		bytes += node->len;
+	}
+	record.tail = node;
+	stash->head = node->next;
+	node->next = NULL;
+
+	ret = copy_record(&record, to);
+	if(ret < 0) {
+		//Keep the record at the head of the claimed ones
+		record.tail->next = stash->head;
+		stash->head = record.head;
+	} else {
+		atomic_long_sub(ret, &obj->claimed[prt]);
+	}
+
+	if(stash->head == NULL) {
+		stash->tail = NULL;
+	}
+
+	mutex_unlock(&(sub->lock));
+
+	if(ret > 0) {
+		wake_writers(obj, prt);
+	}
+
+	return ret;
+}
+
+//Free the blocks at the head of a broadcast flow that every subscriber has read, called
+//with the lock of the flow held. Returns the number of bytes freed
+long trim_flow(object_state *obj, int prt) {
+	long freed;
+	unsigned long oldest;
+	struct subscriber *sub;
+	struct element *node;
+
+	//Files that only write or never read don't keep the data
+	oldest = ULONG_MAX;
+	list_for_each_entry(sub, &obj->subscribers, node) {
+		if(sub->cur[prt].active && sub->cur[prt].seq < oldest) {
+			oldest = sub->cur[prt].seq;
+		}
+	}
+
+	//Without readers the data is kept for the first one
+	if(oldest == ULONG_MAX) {
+		return 0;
+	}
+
+	freed = 0;
+	node = obj->head[prt];
+	while(node != NULL && node->refs == 0 && obj->base[prt] + node->len <= oldest) {
+		obj->head[prt] = node->next;
+		obj->base[prt] += node->len;
+		obj->valid[prt] -= node->len;
+		obj->block_bytes[prt] -= node->len;
+		obj->block_space[prt] -= node->size;
+		freed += node->len;
+
+		free_block(node);
+		node = obj->head[prt];
+	}
+
+	return freed;
+}
+
+//Check if a cursor has need bytes to read in a broadcast flow, the lock of the flow is
+//held only if it has
+int can_read_cursor(object_state *obj, int prt, struct cursor *cur, unsigned long need) {
+	mutex_lock(&(obj->mux_lock[prt]));
+
+	refresh_flow(obj, prt);
+
+	if(obj->base[prt] + obj->valid[prt] - cur->seq >= need) {
+		return 1;
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	return 0;
+}
+
+//Read the next bytes of a broadcast flow with the cursor of the file. The blocks are shared
+//by all the subscribers and freed when the slowest one has read them
+ssize_t broadcast_read(object_state *obj, int prt, struct subscriber *sub, struct iov_iter *to) {
+	int ret;
+	int x;
+	int pos;
+	long freed;
+	unsigned long len;
+	unsigned long copied;
+	unsigned long skip;
+	struct cursor *cur;
+	struct element *node;
+
+	cur = &(sub->cur[prt]);
+	len = iov_iter_count(to);
+
+	mutex_lock(&(sub->lock));
+
+	//The first read starts from the oldest byte still stored, bytes read by all the
+	//other readers may be gone since the open
+	if(!cur->active) {
+		mutex_lock(&(obj->mux_lock[prt]));
+		if(cur->seq < obj->base[prt]) {
+			cur->seq = obj->base[prt];
+		}
+		cur->active = 1;
+		mutex_unlock(&(obj->mux_lock[prt]));
+	}
+
+	if(sub->block) {
+		atomic_inc((atomic_t*)&(obj->asleep[prt]));
+		ret = wait_flow(&(obj->wq_r[prt]), len, flow_readable(obj, sub, prt) >= len, can_read_cursor(obj, prt, cur, len), sub);
+		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+		//Even if there is not enough data, execute a partial read
+		if(ret <= 0) {
+			mutex_lock(&(obj->mux_lock[prt]));
+		}
+	} else {
+		mutex_lock(&(obj->mux_lock[prt]));
+	}
+
+	if(!obj->broadcast) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		mutex_unlock(&(sub->lock));
+		return -EBUSY;
+	}
+
+	refresh_flow(obj, prt);
+
+	skip = obj->base[prt] + obj->valid[prt] - cur->seq;
+	if(skip < len) {
+		len = skip;
+	}
+
+	if(len == 0) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		mutex_unlock(&(sub->lock));
+		return 0;
+	}
+
+	if(cur->block == NULL) {
+		//Find the block of the next byte, the cursor keeps it in the flow
+		skip = cur->seq - obj->base[prt];
+		node = obj->head[prt];
+		while(skip >= node->len) {
+			skip -= node->len;
+			node = node->next;
+		}
+
+		cur->block = node;
+		cur->pos = skip;
+		node->refs++;
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+
+	//Blocks from the one of the cursor on can't be freed, copy them without the lock
+	copied = 0;
+	ret = 0;
+	node = cur->block;
+	pos = cur->pos;
+	while(copied < len) {
+		if(pos == node->len) {
+			node = node->next;
+			pos = 0;
+		}
+
+		x = minimum(len - copied, node->len - pos);
+		ret = x - copy_to_iter(node->data + pos, x, to);
+		copied += x - ret;
+		pos += x - ret;
+		if(ret != 0) {
+			break;
+		}
+	}
+
+	mutex_lock(&(obj->mux_lock[prt]));
+
+	//Move the reference of the cursor to the block of the next byte, a cursor at the
+	//end of the data looks for its block at the next read
+	cur->block->refs--;
+	if(pos < node->len) {
+		cur->block = node;
+		cur->pos = pos;
+		node->refs++;
+	} else {
+		cur->block = NULL;
+	}
+	cur->seq += copied;
+
+	freed = trim_flow(obj, prt);
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	mutex_unlock(&(sub->lock));
+
+	if(freed) {
+		wake_writers(obj, prt);
+	}
+
+	if(ret != 0 && copied == 0) {
+		return -EFAULT;
+	}
+
+	return copied;
+}
+
+//Choose the flow of a read. Strict priority takes the highest level with data, weighted
+//round robin serves weight reads from a level before moving to the next one with data.
+//When no level has data the read waits on the flow of the file priority
+int pick_flow(object_state *obj, struct subscriber *sub) {
+	int prt;
+
+	if(obj->read_mode == READ_STRICT || obj->read_mode == READ_COMBINED) {
+		for(prt = obj->levels - 1; prt >= 0; prt--) {
+			if(flow_readable(obj, sub, prt)) {
+				return prt;
+			}
+		}
+	} else if(obj->read_mode == READ_WRR) {
+		spin_lock(&(obj->rr_lock));
+
+		//Every level is visited once, the current one also after a new round
+		for(int i = 0; i <= obj->levels; i++) {
+			prt = obj->rr_level;
+			if(obj->rr_left > 0 && flow_readable(obj, sub, prt)) {
+				obj->rr_left--;
+				spin_unlock(&(obj->rr_lock));
+				return prt;
+			}
+
+			//Levels are served from the highest one
+			obj->rr_level = prt == 0 ? obj->levels - 1 : prt - 1;
+			obj->rr_left = obj->weight[obj->rr_level];
+		}
+
+		spin_unlock(&(obj->rr_lock));
+	}
+
+	return sub->priority;
+}
+
+//Check if any level has data for the file
+int any_readable(object_state *obj, struct subscriber *sub) {
+	for(int j = 0; j < obj->levels; j++) {
+		if(flow_readable(obj, sub, j)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+//Sleep on the read queues of all the levels until one of them has data for the file,
+//with the timeout and the busy poll window of the session.
+//Returns 1 if there is data, 0 on timeout and -ERESTARTSYS if interrupted
+long wait_any_flow(object_state *obj, struct subscriber *sub) {
+	int levels;
+	long ret;
+	ktime_t start;
+	ktime_t deadline;
+	wait_queue_entry_t waits[FLOWS];
+
+	start = ktime_get();
+	deadline = ktime_add_us(start, sub->timeout);
+
+	if(busy_poll(sub, 1, any_readable(obj, sub), deadline)) {
+		return 1;
+	}
+
+	levels = obj->levels;
+	for(int j = 0; j < levels; j++) {
+		init_waitqueue_entry(&waits[j], current);
+		add_wait_queue(&(obj->wq_r[j].wq), &waits[j]);
+	}
+
+	ret = 1;
+	for(;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(any_readable(obj, sub)) {
+			ret = 1;
+			break;
+		}
+		if(ret == 0) {
+			break;
+		}
+		if(signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		ret = schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS) != 0;
+	}
+	__set_current_state(TASK_RUNNING);
+
+	for(int j = 0; j < levels; j++) {
+		remove_wait_queue(&(obj->wq_r[j].wq), &waits[j]);
+	}
+
+	adapt_poll(sub, ktime_us_delta(ktime_get(), start));
+
+	return ret;
+}
+
+//Fill the buffer from the highest level down to level 0 in a single call, urgent data
+//comes first and the rest of the buffer takes lower priority data. Offsets are not used
+ssize_t combined_read(object_state *obj, struct iov_iter *to) {
+	int ret;
+	int pos;
+	int to_take;
+	ssize_t copied;
+	struct fragmented_data detached;
+
+	copied = 0;
+	for(int prt = obj->levels - 1; prt >= 0 && iov_iter_count(to) > 0; prt--) {
+		mutex_lock(&(obj->mux_lock[prt]));
+
+		if(obj->backend != BACKEND_LIST) {
+			mutex_unlock(&(obj->mux_lock[prt]));
+			return copied ? copied : -EBUSY;
+		}
+
+		refresh_flow(obj, prt);
+
+		to_take = minimum(iov_iter_count(to), obj->valid[prt]);
+		to_take = detach_blocks(obj, prt, to_take, &detached, &pos);
+
+		mutex_unlock(&(obj->mux_lock[prt]));
+
+		if(to_take == 0) {
+			continue;
+		}
+		wake_writers(obj, prt);
+
+		ret = deliver_blocks(obj, prt, &detached, pos, 0, to);
+		if(ret < 0) {
+			return copied ? copied : ret;
+		}
+
+		copied += ret;
+		if(ret < to_take) {
+			//The buffer faulted, the rest stays in the flow
+			break;
+		}
+	}
+
+	return copied;
+}
+
+//Read from the current flow filling every segment of the iterator
+static ssize_t hlm_read(struct kiocb *iocb, struct iov_iter *to) {
+	int ret;
+	int prt;
+	int skip;
+	int pos;
+	int to_take;
+	int block;
+	long waited;
+	size_t need;
+	loff_t start;
+	struct fragmented_data detached;
+	object_state *obj;
+	struct file *filp = iocb->ki_filp;
+	size_t len = iov_iter_count(to);
+	loff_t *off = &(iocb->ki_pos);
+	int minor = get_minor(filp);
+	struct subscriber *sub = filp->private_data;
+
+  	obj = objects + minor;
+
+	if(obj->read_mode == READ_COMBINED) {
+		//Wait for data on any level before choosing where to read from
+		if(sub->block && !any_readable(obj, sub)) {
+			waited = wait_any_flow(obj, sub);
+			if(waited < 0) {
+				return waited;
+			}
+		}
+
+		//Records and cursors are read from the highest level with data
+		if(obj->backend == BACKEND_LIST && !obj->datagram && !obj->broadcast && !obj->group) {
+			return combined_read(obj, to);
+		}
+	}
+
+	prt = pick_flow(obj, sub);
+
+	block = sub->block;
+
+	if(obj->backend == BACKEND_RING) {
+		return ring_read(iocb, to, prt);
+	}
+
+	//Offset can't be negative because the data is canceled
+	if(*off < 0) {
+		return -1;
+	}
+
+	if(obj->broadcast) {
+		return broadcast_read(obj, prt, sub, to);
+	}
+
+	if(obj->group) {
+		return group_read(obj, prt, sub, to);
+	}
+
+	need = len;
+	if(obj->datagram) {
+		//A record can be read as soon as it is in the flow, offsets are not used
+		need = 1;
+		start = 0;
+		off = &start;
+	}
+
+	if(block) {
+		atomic_inc((atomic_t*)&(obj->asleep[prt]));
+		ret = wait_flow(&(obj->wq_r[prt]), need + *off, flow_readable(obj, sub, prt) >= need + *off, can_read(obj, need, off, prt), sub);
+		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+		// Even if there is not enough data, execute a partial read
+		if(ret <= 0) {
+			mutex_lock(&(obj->mux_lock[prt]));
+		}
+	} else {
+		mutex_lock(&(obj->mux_lock[prt]));
+	}
+
+	if(obj->backend != BACKEND_LIST) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		return -EBUSY;
+	}
+
+	refresh_flow(obj, prt);
+
+	if(obj->datagram) {
+		return read_record(obj, prt, to);
+	}
+
+	//Bytes before the offset are discarded, offset and length are clamped in 64 bits so
+	//that both fit in the int counts of the blocks
+	skip = min_t(u64, *off, obj->valid[prt]);
+	to_take = skip + min_t(size_t, len, obj->valid[prt] - skip);
+	to_take = detach_blocks(obj, prt, to_take, &detached, &pos);
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	wake_writers(obj, prt);
+
+	//Copy the detached blocks, the flow is free for other threads
+	return deliver_blocks(obj, prt, &detached, pos, skip, to);
+}
+
+//Queue an array of messages with a single acquisition of the lock and a single wakeup.
+//Messages are queued in order up to the first one that fails, whose error is stored in
+//its result. Returns the number of messages queued
+long send_batch(object_state *obj, struct subscriber *sub, struct hlm_msg *msgs, int count) {
+	int ret;
+	int prt;
+	int block;
+	int prepared;
+	int queued;
+	long total;
+	long waited;
+	struct fragmented_data *frags;
+	struct fragmented_data batch;
+	struct iovec iov;
+	struct iov_iter from;
+
+	prt = sub->priority;
+	block = sub->block;
+
+	//The whole batch waits for the tokens as a single write
+	ret = throttle(obj, sub, prt);
+	if(ret != 0) {
+		msgs[0].ret = ret;
+		for(int i = 1; i < count; i++) {
+			msgs[i].ret = 0;
+		}
+		return 0;
+	}
+
+	//A batch whose first message can't be stored doesn't pay for the copy
+	if(!block && msgs[0].len > flow_room(obj, prt)) {
+		msgs[0].ret = -ENOSPC;
+		for(int i = 1; i < count; i++) {
+			msgs[i].ret = 0;
+		}
+		return 0;
+	}
+
+	frags = kmalloc_array(count, sizeof(struct fragmented_data), GFP_KERNEL);
+	if(frags == NULL) {
+		return -ENOMEM;
+	}
+
+	//Blocks of every message are prepared out of the lock as in hlm_write
+	for(prepared = 0; prepared < count; prepared++) {
+		msgs[prepared].ret = 0;
+
+		if(msgs[prepared].len == 0 || msgs[prepared].len > flow_capacity(obj, prt)) {
+			msgs[prepared].ret = msgs[prepared].len ? -ENOSPC : -EINVAL;
+			break;
+		}
+
+		iov.iov_base = msgs[prepared].buff;
+		iov.iov_len = msgs[prepared].len;
+		iov_iter_init(&from, WRITE, &iov, 1, msgs[prepared].len);
+
+		ret = fragment(obj, prt, &from, msgs[prepared].len, &frags[prepared]);
+		if(ret != 0) {
+			//Partial messages are not queued
+			free_queue(frags[prepared].head);
+			msgs[prepared].ret = ret < 0 ? ret : -EFAULT;
+			break;
+		}
+
+		msgs[prepared].ret = msgs[prepared].len;
+		frags[prepared].head->rec = msgs[prepared].len;
+	}
+
+	queued = 0;
+	if(prepared == 0) {
+		goto out;
+	}
+
+	if(block) {
+		atomic_inc((atomic_t*)&(obj->asleep[prt]));
+		waited = wait_flow(&(obj->wq_w[prt]), msgs[0].len, flow_room(obj, prt) >= msgs[0].len, can_write(obj, prt, msgs[0].len), sub);
+		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+		//The lock is held only if the condition was met
+		if(waited <= 0) {
+			msgs[0].ret = -ENOSPC;
+			goto out;
+		}
+	} else {
+		mutex_lock(&(obj->mux_lock[prt]));
+	}
+
+	if(obj->backend != BACKEND_LIST) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		msgs[0].ret = -EBUSY;
+		goto out;
+	}
+
+	//Messages pushed by lockless writers come before the batch, expired data makes room
+	refresh_flow(obj, prt);
+
+	//Link the messages that fit in a single list
+	total = 0;
+	batch.head = NULL;
+	for(; queued < prepared; queued++) {
+		if(space_occupied(obj, prt) + total + msgs[queued].len > flow_capacity(obj, prt)) {
+			msgs[queued].ret = -ENOSPC;
+			break;
+		}
+
+		total += msgs[queued].len;
+		if(batch.head == NULL) {
+			batch = frags[queued];
+		} else {
+			batch.tail->next = frags[queued].head;
+			batch.tail = frags[queued].tail;
+		}
+	}
+
+	if(batch.head != NULL) {
+		if(prt) {
+			enqueue(obj, prt, &batch);
+			obj->valid[prt] += total;
+		} else {
+			obj->pending += total;
+			schedule_commit(obj, llist_add(&batch.head->llnode, &obj->lo_list));
+		}
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	atomic_long_add(queued, &obj->messages);
+	charge(obj, prt, total);
+
+	if(prt && queued) {
+		wake_readers(obj, prt);
+	}
+
+out:
+	for(int i = queued; i < prepared; i++) {
+		free_queue(frags[i].head);
+	}
+	//Only the first failed message reports an error, the following ones are not considered
+	for(int i = (queued < prepared ? queued : prepared) + 1; i < count; i++) {
+		msgs[i].ret = 0;
+	}
+
+	kfree(frags);
+	return queued;
+}
+
+//Detach up to count records under the lock held by the caller, then copy every record in
+//its own buffer. Returns the number of records received
+long recv_records(object_state *obj, int prt, struct hlm_msg *msgs, int count) {
+	int n;
+	int pos;
+	struct fragmented_data *records;
+	struct iovec iov;
+	struct iov_iter to;
+
+	records = kmalloc_array(count, sizeof(struct fragmented_data), GFP_KERNEL);
+	if(records == NULL) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		return -ENOMEM;
+	}
+
+	for(n = 0; n < count && obj->head[prt] != NULL; n++) {
+		if(obj->head[prt]->rec > msgs[n].len) {
+			//The record stays in the flow
+			msgs[n].ret = -EMSGSIZE;
+			break;
+		}
+
+		msgs[n].ret = detach_blocks(obj, prt, obj->head[prt]->rec, &records[n], &pos);
+	}
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	wake_writers(obj, prt);
+
+	for(int i = 0; i < n; i++) {
+		iov.iov_base = msgs[i].buff;
+		iov.iov_len = msgs[i].len;
+		iov_iter_init(&to, READ, &iov, 1, msgs[i].len);
+
+		if(copy_record(&records[i], &to) < 0) {
+			msgs[i].ret = -EFAULT;
+
+			//Put back the records not delivered keeping their order
+			for(int j = n - 1; j >= i; j--) {
+				give_back(obj, prt, records[j].head, 0, records[j].tail);
+			}
+			for(int j = i + 1; j < n; j++) {
+				msgs[j].ret = 0;
+			}
+
+			n = i;
+			break;
+		}
+	}
+
+	kfree(records);
+	return n;
+}
+
+//Fill an array of buffers from the current flow detaching the data under a single
+//acquisition of the lock. The result of every message is the number of bytes received,
+//returns the number of buffers that received data
+long recv_batch(object_state *obj, struct subscriber *sub, struct hlm_msg *msgs, int count) {
+	int ret;
+	int prt;
+	int block;
+	int pos;
+	int to_take;
+	long received;
+	unsigned long total;
+	unsigned long need;
+	loff_t off;
+	struct fragmented_data detached;
+	struct iovec *iovs;
+	struct iov_iter to;
+
+	prt = sub->priority;
+	block = sub->block;
+
+	iovs = kmalloc_array(count, sizeof(struct iovec), GFP_KERNEL);
+	if(iovs == NULL) {
+		return -ENOMEM;
+	}
+
+	total = 0;
+	for(int i = 0; i < count; i++) {
+		iovs[i].iov_base = msgs[i].buff;
+		iovs[i].iov_len = msgs[i].len;
+		total += msgs[i].len;
+		msgs[i].ret = 0;
+	}
+	iov_iter_init(&to, READ, iovs, count, total);
+
+	//Wait only for the first buffer, the others take what is there
+	off = 0;
+	need = obj->datagram ? 1 : msgs[0].len;
+	if(block) {
+		atomic_inc((atomic_t*)&(obj->asleep[prt]));
+		ret = wait_flow(&(obj->wq_r[prt]), need, flow_readable(obj, sub, prt) >= need, can_read(obj, need, &off, prt), sub);
+		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+
+		if(ret <= 0) {
+			mutex_lock(&(obj->mux_lock[prt]));
+		}
+	} else {
+		mutex_lock(&(obj->mux_lock[prt]));
+	}
+
+	if(obj->backend != BACKEND_LIST) {
+		mutex_unlock(&(obj->mux_lock[prt]));
+		kfree(iovs);
+		return -EBUSY;
+	}
+
+	refresh_flow(obj, prt);
+
+	if(obj->datagram) {
+		kfree(iovs);
+		return recv_records(obj, prt, msgs, count);
+	}
+
+	to_take = total < obj->valid[prt] ? total : obj->valid[prt];
+	to_take = detach_blocks(obj, prt, to_take, &detached, &pos);
+
+	mutex_unlock(&(obj->mux_lock[prt]));
+	wake_writers(obj, prt);
+
+	ret = deliver_blocks(obj, prt, &detached, pos, 0, &to);
+	kfree(iovs);
+
+	if(ret < 0) {
+		return ret;
+	}
+
+	//Buffers are filled in order
+	received = 0;
+	for(int i = 0; i < count && ret > 0; i++) {
+		msgs[i].ret = minimum(msgs[i].len, ret);
+		ret -= msgs[i].ret;
+		received++;
+	}
+
+	return received;
+}
+
+//Copy the array of a batch from the user, run it and give back the per-message results
+long batch_ioctl(object_state *obj, struct subscriber *sub, unsigned int command, struct hlm_batch __user *arg) {
+	long ret;
+	struct hlm_batch batch;
+	struct hlm_msg *msgs;
+
+	if(copy_from_user(&batch, arg, sizeof(batch)) != 0) {
+		return -EFAULT;
+	}
+
+	if(batch.count == 0 || batch.count > BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	//Batches are built on the blocks of the list backend, broadcast files read with a cursor
+	if(obj->backend != BACKEND_LIST || (command == RECV_BATCH && obj->broadcast)) {
+		return -EINVAL;
+	}
 
-		if(space_occupied(obj, prt) + (len - ret) > max_bytes) {
-			mutex_unlock(&(obj->mux_lock[prt]));
-			free_queue(frag_data->head);
-			kfree(frag_data);
-			return -ENOSPC;
-		}
-	} else {
-		mutex_lock(&(obj->mux_lock[prt]));
+	msgs = kmalloc_array(batch.count, sizeof(struct hlm_msg), GFP_KERNEL);
+	if(msgs == NULL) {
+		return -ENOMEM;
+	}
 
-		if(space_occupied(obj, prt) + (len - ret) > max_bytes) {
-			mutex_unlock(&(obj->mux_lock[prt]));
-			free_queue(frag_data->head);
-			kfree(frag_data);
-			return -ENOSPC;
-		}
+	if(copy_from_user(msgs, batch.msgs, batch.count * sizeof(struct hlm_msg)) != 0) {
+		kfree(msgs);
+		return -EFAULT;
 	}
 
-	if(prt) {
-		enqueue(obj, 1, frag_data);
-		obj->valid[prt] += len - ret;
+	if(command == SEND_BATCH) {
+		ret = send_batch(obj, sub, msgs, batch.count);
 	} else {
-		//Prepare work data
-		data = kmalloc(sizeof(struct work_data), GFP_KERNEL);
-		if(data == NULL) {
-			mutex_unlock(&(obj->mux_lock[prt]));
-			free_queue(frag_data->head);
-			kfree(frag_data);
-			return -ENOMEM;
-		}
-
-		data->data = frag_data;
-		data->minor = minor;
-		data->len = len - ret;
+		ret = recv_batch(obj, sub, msgs, batch.count);
+	}
 
-		INIT_WORK(&data->work, work_handler);
-		obj->pending += len - ret;
-		queue_work(wq, &data->work);
+	if(copy_to_user(batch.msgs, msgs, batch.count * sizeof(struct hlm_msg)) != 0) {
+		ret = -EFAULT;
 	}
 
-	mutex_unlock(&(obj->mux_lock[prt]));
+	kfree(msgs);
+	return ret;
+}
 
-	return len - ret;
+//Shared rings are readable with committed bytes and writable when below capacity
+int shm_readable(struct hlm_shm_flow *flow) {
+	return smp_load_acquire(&(flow->commit)) != READ_ONCE(flow->tail);
 }
 
-//Check if a reader has enough data to read
-int can_read(object_state *obj, int to_read, loff_t *off, int prt) {
-	mutex_lock(&(obj->mux_lock[prt]));
+int shm_writable(struct hlm_shm_flow *flow) {
+	return READ_ONCE(flow->head) - smp_load_acquire(&(flow->tail)) < flow->capacity;
+}
 
-	if(to_read + *off <= obj->valid[prt]) {
-		return 1;
+//Allocate the control page and the data of the shared rings of a device
+int shm_create(object_state *obj) {
+	struct hlm_shm *shm;
+	unsigned long data_size[2];
+	unsigned long size;
+
+	//The rings are sized to the capacity of their flow at the time of the first mmap
+	size = PAGE_SIZE;
+	for(int j = 0; j < 2; j++) {
+		data_size[j] = PAGE_ALIGN(obj->max_bytes[j]);
+		size += data_size[j];
 	}
 
-	mutex_unlock(&(obj->mux_lock[prt]));
+	shm = vmalloc_user(size);
+	if(shm == NULL) {
+		return -ENOMEM;
+	}
+
+	for(int j = 0; j < 2; j++) {
+		shm->flow[j].size = data_size[j];
+		shm->flow[j].offset = j ? PAGE_SIZE + data_size[0] : PAGE_SIZE;
+		shm->flow[j].capacity = obj->max_bytes[j];
+	}
+
+	obj->shm_size = size;
+	smp_store_release(&(obj->shm), shm);
+
 	return 0;
 }
 
-static ssize_t hlm_read(struct file *filp, char *buff, size_t len, loff_t *off) {
+//Map the control page followed by the data of the 2 shared rings
+static int hlm_mmap(struct file *filp, struct vm_area_struct *vma) {
 	int ret;
-	int prt;
-	int to_read;
-	int x;
-	int lenght;
-	int block;
-	int timeout;
-	struct element **head;
-	struct element **tail; 
-	struct element *tmp;
 	object_state *obj;
 	int minor = get_minor(filp);
 
-  	obj = objects + minor;
-	prt = obj->priority;
+	obj = objects + minor;
 
-	head = &(obj->head[prt]);
-	tail = &(obj->tail[prt]);
-	to_read = len;
+	if(smp_load_acquire(&(obj->shm)) == NULL) {
+		//The locks of the flows are held across user copies that can fault and take
+		//mmap_lock, creation has a lock of its own
+		mutex_lock(&(obj->shm_lock));
+		ret = obj->shm == NULL ? shm_create(obj) : 0;
+		mutex_unlock(&(obj->shm_lock));
 
-	block = obj->block;
-	timeout = obj->timeout;
+		if(ret != 0) {
+			return ret;
+		}
+	}
 
-	//Offset can't be negative because the data is canceled
-	if(*off < 0) {
-		return -1;
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > obj->shm_size) {
+		return -EINVAL;
 	}
 
-    // Even if there is not enough data, execute a partial read
-	if(block) {
-		atomic_inc((atomic_t*)&(obj->asleep[prt]));
-		wait_event_interruptible_timeout(obj->wq_r, can_read(obj, to_read, off, prt), timeout);
-		atomic_dec((atomic_t*)&(obj->asleep[prt]));
+	ret = remap_vmalloc_range(vma, obj->shm, 0);
+	if(ret == 0) {
+		((struct subscriber *)filp->private_data)->mapped = 1;
+	}
+
+	return ret;
+}
+
+//Sleep or wake commands of the shared rings, kept out of the logging of hlm_ioctl
+//since they are on the fast path
+long shm_ioctl(object_state *obj, struct subscriber *sub, unsigned int command, int32_t value) {
+	long ret;
+	int prt;
+	struct hlm_shm_flow *flow;
+
+	if(obj->shm == NULL) {
+		return -EINVAL;
+	}
+
+	prt = value & 1;
+	flow = &(obj->shm->flow[prt]);
+
+	if(command == SHM_NOTIFY) {
+		//Low priority bytes are committed by the deferred work
+		if(prt) {
+			shm_commit(flow);
+			wake_flow(&(obj->wq_r[prt]), ULONG_MAX);
+		} else if(READ_ONCE(flow->head) != READ_ONCE(flow->commit)) {
+			queue_work(obj->work_queue, &obj->lo_work);
+		}
+
+		if(wq_has_sleeper(&(obj->wq_w[prt].wq))) {
+			wake_flow(&(obj->wq_w[prt]), ULONG_MAX);
+		}
+
+		return 0;
+	}
+
+	if(value & SHM_WAIT_SPACE) {
+		ret = wait_flow(&(obj->wq_w[prt]), 0, 1, shm_writable(flow), sub);
 	} else {
-		mutex_lock(&(obj->mux_lock[prt]));
+		ret = wait_flow(&(obj->wq_r[prt]), 0, 1, shm_readable(flow), sub);
 	}
 
-	//Update reading position with the offset
-	obj->r_pos[prt] += *off;
+	if(ret == 0) {
+		return -ETIMEDOUT;
+	}
 
-	while(to_read > 0 && obj->head[prt] != NULL) {
-		tmp = *head;
+	return ret < 0 ? ret : 0;
+}
 
-		//Available data in the current node
-		lenght = tmp->len - obj->r_pos[prt];
+//Readiness of the current flow, readable with valid bytes and writable with free space
+static __poll_t hlm_poll(struct file *filp, poll_table *wait) {
+	int prt;
+	__poll_t mask;
+	unsigned long readable;
+	struct hlm_shm_flow *flow;
+	object_state *obj;
+	int minor = get_minor(filp);
 
-		if(to_read >= lenght) {
-			//If there isn't enough data in the current node skip to the next one
-			x = lenght;
+	obj = objects + minor;
+	prt = ((struct subscriber *)filp->private_data)->priority;
 
-			ret = copy_to_user(buff + (len - to_read), tmp->data + obj->r_pos[prt], x);
-			if(ret != 0) {
-				//Not all bytes were delivered reset reading position
-				obj->r_pos[prt] = x - ret;
-				to_read -= x - ret;
-				break;
-			} else {
-				//All bytes were read, block can be freed
-				//Set the head to the next block
-				*head = tmp->next;
-				kfree(tmp->data);
-				kfree(tmp);
-				obj->r_pos[prt] = 0;
-			}
-		} else {
-			//Partial read of the node
-			x = to_read;
-			ret = copy_to_user(buff + (len - to_read), tmp->data + obj->r_pos[prt], x);
-			if(ret != 0) {
-				//Not all bytes were delivered
-				obj->r_pos[prt] -= x - ret;
-				to_read -= x - ret;
-				break;
+	//Combined reads are served by any level
+	if(obj->read_mode != READ_FLOW) {
+		for(int j = 0; j < obj->levels; j++) {
+			if(j != prt) {
+				poll_wait(filp, &(obj->wq_r[j].wq), wait);
 			}
+		}
+	}
+	poll_wait(filp, &(obj->wq_r[prt].wq), wait);
+	poll_wait(filp, &(obj->wq_w[prt].wq), wait);
 
-			//Update reading position with the bytes read
-			obj->r_pos[prt] += x;
+	mask = 0;
+
+	if(obj->shm != NULL && ((struct subscriber *)filp->private_data)->mapped) {
+		//Readiness of the ring shared with user space, synchronous levels use the
+		//high priority ring
+		flow = &(obj->shm->flow[prt ? 1 : 0]);
+		if(shm_readable(flow)) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+		if(shm_writable(flow)) {
+			mask |= EPOLLOUT | EPOLLWRNORM;
 		}
-		
-		to_read -= x;
+
+		return mask;
 	}
 
-	//Update the valid number of bytes in the flow
-	obj->valid[prt] -= len - to_read;
+	readable = flow_readable(obj, filp->private_data, prt);
+	if(obj->read_mode != READ_FLOW) {
+		for(int j = 0; j < obj->levels; j++) {
+			readable += flow_readable(obj, filp->private_data, j);
+		}
+	}
 
-	mutex_unlock(&(obj->mux_lock[prt]));
-	wake_up(&(obj->wq_w));
+	if(readable > 0) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	//Pending low priority bytes already take space in the flow
+	if(space_occupied(obj, prt) < flow_capacity(obj, prt)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+}
+
+//Move data from the current flow to a pipe with one copy from the blocks to pipe pages.
+//Blocks live in slab caches, which can't be lent to a pipe as page references, so this
+//is the generic copy of a read_iter device: copy_splice_read since 6.5, an ITER_PIPE
+//before, where generic_file_splice_read can't be used since 6.4 reads the page cache
+static ssize_t hlm_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	return copy_splice_read(in, ppos, pipe, len, flags);
+#else
+	struct iov_iter to;
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	iov_iter_pipe(&to, READ, pipe, len);
+	init_sync_kiocb(&kiocb, in);
+	kiocb.ki_pos = *ppos;
 
-	return len - to_read;
+	ret = hlm_read(&kiocb, &to);
+	if(ret > 0) {
+		*ppos = kiocb.ki_pos;
+	}
+
+	return ret;
+#endif
 }
 
 static int hlm_open(struct inode *inode, struct file *file) {
 	int minor;
+	object_state *obj;
+	struct subscriber *sub;
 	minor = get_minor(file);
+	obj = objects + minor;
 
 	//Check if the minor is enabled
 	if(objects[minor].enabled == 0){
@@ -426,12 +3114,83 @@ static int hlm_open(struct inode *inode, struct file *file) {
 		return -ENODEV;
 	}
 
+	sub = kmalloc(sizeof(struct subscriber), GFP_KERNEL);
+	if(sub == NULL) {
+		return -ENOMEM;
+	}
+	mutex_init(&(sub->lock));
+
+	lock_flows(obj);
+
+	//Broadcast subscribers start from the oldest byte still stored
+	for(int j = 0; j < FLOWS; j++) {
+		sub->cur[j].block = NULL;
+		sub->cur[j].pos = 0;
+		sub->cur[j].seq = obj->base[j];
+		sub->cur[j].active = 0;
+		sub->stash[j].head = NULL;
+		sub->stash[j].tail = NULL;
+	}
+
+	//The settings of the device are the defaults of the session
+	sub->priority = obj->priority;
+	sub->block = obj->block;
+	sub->timeout = obj->timeout;
+	sub->busy_poll = obj->busy_poll;
+	sub->poll_window = obj->busy_poll;
+	sub->mapped = 0;
+	list_add_tail(&(sub->node), &obj->subscribers);
+
+	unlock_flows(obj);
+
+	file->private_data = sub;
+
 	printk("%s: hlm dev opened %d\n",MODNAME, minor);
   	return 0;
 }
 
-//Used only for debugging purposes
+//Remove the file from the subscribers, the blocks it was the last to read are freed
 static int hlm_release(struct inode *inode, struct file *file) {
+	long freed[FLOWS];
+	object_state *obj;
+	struct subscriber *sub = file->private_data;
+	int minor = get_minor(file);
+
+	obj = objects + minor;
+
+	//Records claimed and not read go back to the group
+	for(int j = 0; j < FLOWS; j++) {
+		if(sub->stash[j].head != NULL) {
+			freed[j] = 0;
+			for(struct element *node = sub->stash[j].head; node != NULL; node = node->next) {
+				freed[j] += node->len;
+			}
+
+			give_back(obj, j, sub->stash[j].head, 0, sub->stash[j].tail);
+			atomic_long_sub(freed[j], &obj->claimed[j]);
+		}
+	}
+
+	lock_flows(obj);
+
+	list_del(&(sub->node));
+	for(int j = 0; j < FLOWS; j++) {
+		if(sub->cur[j].block != NULL) {
+			sub->cur[j].block->refs--;
+		}
+		freed[j] = obj->broadcast ? trim_flow(obj, j) : 0;
+	}
+
+	unlock_flows(obj);
+
+	for(int j = 0; j < FLOWS; j++) {
+		if(freed[j]) {
+			wake_writers(obj, j);
+		}
+	}
+
+	kfree(sub);
+
 	printk("%s: hlm dev closed\n",MODNAME);
    	return 0;
 }
@@ -441,22 +3200,33 @@ static long hlm_ioctl(struct file *filp, unsigned int command, unsigned long par
   	int ret;
   	int minor = get_minor(filp);
   	object_state *obj = objects + minor;
+  	struct subscriber *sub = filp->private_data;
+
+  	//The argument of a batch is a struct hlm_batch
+  	if(command == SEND_BATCH || command == RECV_BATCH) {
+  		return batch_ioctl(obj, sub, command, (struct hlm_batch __user *) param);
+  	}
 
   	ret = copy_from_user(&value ,(int32_t*) param, sizeof(value));
   	if(ret != 0) {
   		printk("%s: error in ioctl\n", MODNAME);
   	}
 
+  	if(command == SHM_NOTIFY || command == SHM_WAIT) {
+  		return shm_ioctl(obj, sub, command, value);
+  	}
+
   	printk("%s: ioctl called on minor %d  with command %d\n",MODNAME,get_minor(filp),command);
 
+  	//Priority, timeout and blocking behaviour change only the session of the file
   	switch(command) {
         case CHG_PRT:
-	        if(value != 0 && value != 1) {
+	        if(value < 0 || value >= obj->levels) {
 		    	printk("%s: invalid priority %d\n",MODNAME,value);
 		    	return -1;
 		    } else {
 		    	printk("%s: changed priority to %d\n",MODNAME,value);
-		    	obj->priority = value;
+		    	sub->priority = value;
 		    }
 		    break;
 
@@ -477,20 +3247,227 @@ static long hlm_ioctl(struct file *filp, unsigned int command, unsigned long par
 		 		return -1;
 		 	} else {
 		 		printk("%s: changing timeout to %d\n", MODNAME, value);
-		 		obj->timeout = value;
+		 		sub->timeout = div_u64(jiffies_to_nsecs(value), NSEC_PER_USEC);
 		 	}
 		 	break;
 
+		case CHG_TIMEOUT_US:
+			if(value <= 0) {
+				printk("%s: invalid timeout value %d us\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing timeout to %d us\n", MODNAME, value);
+				sub->timeout = value;
+			}
+			break;
+
+		case CHG_BUSY_POLL:
+			if(value < 0) {
+				printk("%s: invalid busy poll value %d us\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing busy poll to %d us\n", MODNAME, value);
+				WRITE_ONCE(sub->busy_poll, value);
+				WRITE_ONCE(sub->poll_window, value);
+			}
+			break;
+
 		 case CHG_BLK:
 		 	if(value != 0 && value != 1) {
 		 		printk("%s: invalid block value %d\n",MODNAME,value);
 		 		return -1;
 		 	} else {
 		 		printk("%s: changing blocking behaviour to %d\n", MODNAME, value);
-		 		obj->block = value;
+		 		sub->block = value;
 		 	}
 		 	break;
 
+		case CHG_LOCKLESS:
+			if(value != 0 && value != 1) {
+				printk("%s: invalid lockless value %d\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing lockless high priority writes to %d\n", MODNAME, value);
+				obj->lockless = value;
+			}
+			break;
+
+		case CHG_BACKEND:
+			if(value != BACKEND_LIST && value != BACKEND_RING) {
+				printk("%s: invalid backend %d\n",MODNAME,value);
+				return -1;
+			}
+
+			ret = set_backend(obj, value);
+			if(ret != 0) {
+				printk("%s: cannot change backend to %d\n",MODNAME,value);
+				return ret;
+			}
+
+			printk("%s: changed backend to %d\n",MODNAME,value);
+			break;
+
+		case CHG_DATAGRAM:
+			if(value != 0 && value != 1) {
+				printk("%s: invalid datagram value %d\n",MODNAME,value);
+				return -1;
+			}
+
+			ret = set_datagram(obj, value);
+			if(ret != 0) {
+				printk("%s: cannot change datagram mode to %d\n",MODNAME,value);
+				return ret;
+			}
+
+			printk("%s: changed datagram mode to %d\n",MODNAME,value);
+			break;
+
+		case CHG_PARTIAL:
+			if(value != 0 && value != 1) {
+				printk("%s: invalid partial value %d\n",MODNAME,value);
+				return -1;
+			}
+
+			ret = set_partial(obj, value);
+			if(ret != 0) {
+				printk("%s: cannot change partial writes to %d\n",MODNAME,value);
+				return ret;
+			}
+
+			printk("%s: changed partial writes to %d\n",MODNAME,value);
+			break;
+
+		case CHG_BROADCAST:
+			if(value != 0 && value != 1) {
+				printk("%s: invalid broadcast value %d\n",MODNAME,value);
+				return -1;
+			}
+
+			ret = set_broadcast(obj, value);
+			if(ret != 0) {
+				printk("%s: cannot change broadcast mode to %d\n",MODNAME,value);
+				return ret;
+			}
+
+			printk("%s: changed broadcast mode to %d\n",MODNAME,value);
+			break;
+
+		case CHG_GROUP:
+			if(value != 0 && value != 1) {
+				printk("%s: invalid group value %d\n",MODNAME,value);
+				return -1;
+			}
+
+			ret = set_group(obj, value);
+			if(ret != 0) {
+				printk("%s: cannot change consumer group mode to %d\n",MODNAME,value);
+				return ret;
+			}
+
+			printk("%s: changed consumer group mode to %d\n",MODNAME,value);
+			break;
+
+		case CHG_LEVELS:
+			if(value < 2 || value > FLOWS) {
+				printk("%s: invalid number of levels %d\n",MODNAME,value);
+				return -1;
+			}
+
+			ret = set_levels(obj, value);
+			if(ret != 0) {
+				printk("%s: cannot change the number of levels to %d\n",MODNAME,value);
+				return ret;
+			}
+
+			printk("%s: changed the number of levels to %d\n",MODNAME,value);
+			break;
+
+		case CHG_READ_MODE:
+			if(value < READ_FLOW || value > READ_COMBINED) {
+				printk("%s: invalid read mode %d\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing read mode to %d\n", MODNAME, value);
+				obj->read_mode = value;
+			}
+			break;
+
+		case CHG_WEIGHT:
+			//The level is in the second byte of the value, the weight in the first one
+			if((value >> 8) < 0 || (value >> 8) >= FLOWS || (value & 0xff) == 0) {
+				printk("%s: invalid weight %d\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing weight of level %d to %d\n", MODNAME, value >> 8, value & 0xff);
+				obj->weight[value >> 8] = value & 0xff;
+			}
+			break;
+
+		case CHG_RATE:
+		case CHG_BURST:
+			//The level is in the last byte of the value, the limit in KiB in the others
+			if(((value >> 24) >= FLOWS && (value >> 24) != HLM_DEVICE) || (value >> 24) < 0) {
+				printk("%s: invalid limit %d\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing %s of level %d to %d KiB\n", MODNAME, command == CHG_RATE ? "rate" : "burst",
+					value >> 24, value & 0xffffff);
+				set_limit(obj, (value >> 24) == HLM_DEVICE ? -1 : value >> 24, command == CHG_BURST, (unsigned long)(value & 0xffffff) << 10);
+			}
+			break;
+
+		case CHG_FLUSH_INTERVAL:
+		case CHG_FLUSH_BYTES:
+			if(value < 0) {
+				printk("%s: invalid flush value %d\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing flush %s to %d\n", MODNAME, command == CHG_FLUSH_BYTES ? "bytes" : "interval", value);
+				set_flush(obj, command == CHG_FLUSH_BYTES, value);
+			}
+			break;
+
+		case CHG_MAX_BYTES:
+		case CHG_BLOCK_SIZE:
+			//The level is in the last byte of the value, the size in bytes in the others
+			if(((value >> 24) >= FLOWS && (value >> 24) != HLM_DEVICE) || (value >> 24) < 0 || (value & 0xffffff) == 0) {
+				printk("%s: invalid size %d\n",MODNAME,value);
+				return -1;
+			}
+
+			printk("%s: changing %s of level %d to %d\n", MODNAME, command == CHG_MAX_BYTES ? "capacity" : "block size",
+				value >> 24, value & 0xffffff);
+			for(int j = 0; j < FLOWS; j++) {
+				if((value >> 24) != HLM_DEVICE && (value >> 24) != j) {
+					continue;
+				}
+
+				if(command == CHG_BLOCK_SIZE) {
+					ret = set_block_size(obj, j, value & 0xffffff);
+					if(ret != 0) {
+						printk("%s: block size of level %d above %d\n",MODNAME,j,BLOCK_SIZE_MAX);
+						return ret;
+					}
+				} else {
+					ret = set_capacity(obj, j, value & 0xffffff);
+					if(ret != 0) {
+						printk("%s: cannot change capacity of level %d\n",MODNAME,j);
+						return ret;
+					}
+				}
+			}
+			break;
+
+		case CHG_TTL:
+			if(value < 0) {
+				printk("%s: invalid ttl %d\n",MODNAME,value);
+				return -1;
+			} else {
+				printk("%s: changing ttl of low priority data to %d ms\n", MODNAME, value);
+				set_ttl(obj, value);
+			}
+			break;
+
         default:
             printk("%s: invalid ioctl command\n",MODNAME);
             return -1;
@@ -502,10 +3479,15 @@ static long hlm_ioctl(struct file *filp, unsigned int command, unsigned long par
 
 static struct file_operations fops = {
   .owner = THIS_MODULE,
-  .write = hlm_write,
-  .read = hlm_read,
+  .write_iter = hlm_write,
+  .read_iter = hlm_read,
+  .poll = hlm_poll,
   .open =  hlm_open,
   .unlocked_ioctl = hlm_ioctl,
+  .mmap = hlm_mmap,
+  .splice_read = hlm_splice_read,
+  //Every chunk of the pipe becomes a single message through hlm_write
+  .splice_write = iter_file_splice_write,
   .release = hlm_release
 };
 
@@ -525,7 +3507,21 @@ static ssize_t sysfs_show(struct kobject *kobj, struct kobj_attribute *attr, cha
 	} else if(!strcmp(attr->attr.name, "block")) {
 		out = obj->block;
 	} else if(!strcmp(attr->attr.name, "timeout")) {
+		out = nsecs_to_jiffies((u64)obj->timeout * NSEC_PER_USEC);
+	} else if(!strcmp(attr->attr.name, "timeout_us")) {
 		out = obj->timeout;
+	} else if(!strcmp(attr->attr.name, "busy_poll")) {
+		out = obj->busy_poll;
+	} else if(!strcmp(attr->attr.name, "ttl")) {
+		out = obj->ttl;
+	} else if(!strcmp(attr->attr.name, "flush_interval")) {
+		out = obj->flush_interval;
+	} else if(!strcmp(attr->attr.name, "flush_bytes")) {
+		out = obj->flush_bytes;
+	} else if(!strcmp(attr->attr.name, "commits")) {
+		out = obj->commits;
+	} else if(!strcmp(attr->attr.name, "expired_lo")) {
+		out = obj->expired;
 	} else if(!strcmp(attr->attr.name, "priority")) {
 		out = obj->priority;
 	} else if(!strcmp(attr->attr.name, "asleep_hi")) {
@@ -533,9 +3529,67 @@ static ssize_t sysfs_show(struct kobject *kobj, struct kobj_attribute *attr, cha
 	} else if(!strcmp(attr->attr.name, "asleep_lo")) {
 		out = obj->asleep[0];
 	} else if(!strcmp(attr->attr.name, "bytes_hi")) {
-		out = obj->valid[1];
+		out = obj->valid[1] + atomic_long_read(&obj->hi_pushed[1]);
 	} else if(!strcmp(attr->attr.name, "bytes_lo")) {
 		out = obj->valid[0];
+	} else if(!strcmp(attr->attr.name, "allocs")) {
+		out = atomic_long_read(&obj->allocs);
+	} else if(!strcmp(attr->attr.name, "messages")) {
+		out = atomic_long_read(&obj->messages);
+	} else if(!strcmp(attr->attr.name, "backend")) {
+		out = obj->backend;
+	} else if(!strcmp(attr->attr.name, "lockless")) {
+		out = obj->lockless;
+	} else if(!strcmp(attr->attr.name, "datagram")) {
+		out = obj->datagram;
+	} else if(!strcmp(attr->attr.name, "partial")) {
+		out = obj->partial;
+	} else if(!strcmp(attr->attr.name, "broadcast")) {
+		out = obj->broadcast;
+	} else if(!strcmp(attr->attr.name, "group")) {
+		out = obj->group;
+	} else if(!strcmp(attr->attr.name, "levels")) {
+		out = obj->levels;
+	} else if(!strcmp(attr->attr.name, "read_mode")) {
+		out = obj->read_mode;
+	} else if(!strcmp(attr->attr.name, "bytes")) {
+		//Bytes stored in every level, from level 0
+		out = 0;
+		for(int j = 0; j < obj->levels; j++) {
+			out += sprintf(buf + out, j ? " %lu" : "%lu", obj->valid[j] + atomic_long_read(&obj->hi_pushed[j]));
+		}
+		return out;
+	} else if(!strcmp(attr->attr.name, "flow_rate") || !strcmp(attr->attr.name, "flow_burst") ||
+		!strcmp(attr->attr.name, "throttled")) {
+		//Rate limits in bytes and writes throttled of every level, from level 0
+		out = 0;
+		for(int j = 0; j < obj->levels; j++) {
+			if(!strcmp(attr->attr.name, "flow_rate")) {
+				num = obj->bucket[j].rate;
+			} else if(!strcmp(attr->attr.name, "flow_burst")) {
+				num = bucket_size(&(obj->bucket[j]));
+			} else {
+				num = atomic_long_read(&obj->throttled[j]);
+			}
+			out += sprintf(buf + out, j ? " %ld" : "%ld", num);
+		}
+		return out;
+	} else if(!strcmp(attr->attr.name, "max_bytes") || !strcmp(attr->attr.name, "block_size")) {
+		//Capacity and block size of every level, from level 0
+		out = 0;
+		for(int j = 0; j < obj->levels; j++) {
+			num = !strcmp(attr->attr.name, "max_bytes") ? obj->max_bytes[j] : obj->block_size[j];
+			out += sprintf(buf + out, j ? " %ld" : "%ld", num);
+		}
+		return out;
+	} else if(!strcmp(attr->attr.name, "rate")) {
+		out = obj->dev_bucket.rate;
+	} else if(!strcmp(attr->attr.name, "burst")) {
+		out = bucket_size(&(obj->dev_bucket));
+	} else if(!strcmp(attr->attr.name, "fill_hi")) {
+		out = obj->block_space[1] ? 100 * obj->block_bytes[1] / obj->block_space[1] : 0;
+	} else if(!strcmp(attr->attr.name, "fill_lo")) {
+		out = obj->block_space[0] ? 100 * obj->block_bytes[0] / obj->block_space[0] : 0;
 	}
 
 	return sprintf(buf, "%lu", out);
@@ -544,6 +3598,7 @@ static ssize_t sysfs_show(struct kobject *kobj, struct kobj_attribute *attr, cha
 static ssize_t sysfs_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count) {
 	unsigned long in;
     long num;
+	int level;
 	object_state *obj;
 
 	if(kstrtol(kobj->name, 10, &num)) {
@@ -559,9 +3614,118 @@ static ssize_t sysfs_store(struct kobject *kobj, struct kobj_attribute *attr,con
 	} else if(!strcmp(attr->attr.name, "block")) {
 		obj->block = in;
 	} else if(!strcmp(attr->attr.name, "timeout")) {
+		obj->timeout = div_u64(jiffies_to_nsecs(in), NSEC_PER_USEC);
+	} else if(!strcmp(attr->attr.name, "timeout_us")) {
+		if(in == 0 || in > INT_MAX) {
+			return -EINVAL;
+		}
 		obj->timeout = in;
+	} else if(!strcmp(attr->attr.name, "busy_poll")) {
+		if(in > INT_MAX) {
+			return -EINVAL;
+		}
+		obj->busy_poll = in;
+	} else if(!strcmp(attr->attr.name, "ttl")) {
+		if(in > INT_MAX) {
+			return -EINVAL;
+		}
+		set_ttl(obj, in);
+	} else if(!strcmp(attr->attr.name, "flush_interval") || !strcmp(attr->attr.name, "flush_bytes")) {
+		if(in > INT_MAX) {
+			return -EINVAL;
+		}
+		set_flush(obj, !strcmp(attr->attr.name, "flush_bytes"), in);
+	} else if(!strcmp(attr->attr.name, "rate") || !strcmp(attr->attr.name, "burst")) {
+		set_limit(obj, -1, !strcmp(attr->attr.name, "burst"), in);
+	} else if(!strcmp(attr->attr.name, "flow_rate") || !strcmp(attr->attr.name, "flow_burst")) {
+		//The level is written before the value
+		if(sscanf(buf, "%d %lu", &level, &in) != 2 || level < 0 || level >= FLOWS) {
+			return -EINVAL;
+		}
+		set_limit(obj, level, !strcmp(attr->attr.name, "flow_burst"), in);
+	} else if(!strcmp(attr->attr.name, "max_bytes") || !strcmp(attr->attr.name, "block_size")) {
+		//A single value changes all the levels, otherwise the level is written first
+		if(sscanf(buf, "%d %lu", &level, &in) != 2) {
+			level = -1;
+		}
+
+		if(level >= FLOWS || in == 0 || in > INT_MAX) {
+			return -EINVAL;
+		}
+
+		for(int j = 0; j < FLOWS; j++) {
+			if(level >= 0 && level != j) {
+				continue;
+			}
+
+			if(!strcmp(attr->attr.name, "block_size")) {
+				if(set_block_size(obj, j, in)) {
+					return -EINVAL;
+				}
+			} else if(set_capacity(obj, j, in)) {
+				return -EBUSY;
+			}
+		}
 	} else if(!strcmp(attr->attr.name, "priority")) {
+		if(in >= obj->levels) {
+			return -EINVAL;
+		}
 		obj->priority = in;
+	} else if(!strcmp(attr->attr.name, "lockless")) {
+		obj->lockless = in;
+	} else if(!strcmp(attr->attr.name, "backend")) {
+		if(in != BACKEND_LIST && in != BACKEND_RING) {
+			return -EINVAL;
+		}
+
+		if(set_backend(obj, in)) {
+			return -EBUSY;
+		}
+	} else if(!strcmp(attr->attr.name, "datagram")) {
+		if(in != 0 && in != 1) {
+			return -EINVAL;
+		}
+
+		if(set_datagram(obj, in)) {
+			return -EBUSY;
+		}
+	} else if(!strcmp(attr->attr.name, "partial")) {
+		if(in != 0 && in != 1) {
+			return -EINVAL;
+		}
+
+		if(set_partial(obj, in)) {
+			return -EINVAL;
+		}
+	} else if(!strcmp(attr->attr.name, "broadcast")) {
+		if(in != 0 && in != 1) {
+			return -EINVAL;
+		}
+
+		if(set_broadcast(obj, in)) {
+			return -EBUSY;
+		}
+	} else if(!strcmp(attr->attr.name, "group")) {
+		if(in != 0 && in != 1) {
+			return -EINVAL;
+		}
+
+		if(set_group(obj, in)) {
+			return -EBUSY;
+		}
+	} else if(!strcmp(attr->attr.name, "levels")) {
+		if(in < 2 || in > FLOWS) {
+			return -EINVAL;
+		}
+
+		if(set_levels(obj, in)) {
+			return -EBUSY;
+		}
+	} else if(!strcmp(attr->attr.name, "read_mode")) {
+		if(in > READ_COMBINED) {
+			return -EINVAL;
+		}
+		obj->read_mode = in;
 	}
 
     return count;
@@ -572,11 +3736,38 @@ struct kobj_attribute bytes_lo_attr = __ATTR(bytes_lo, 0660, sysfs_show, NULL);
 struct kobj_attribute bytes_hi_attr = __ATTR(bytes_hi, 0660, sysfs_show, NULL);
 struct kobj_attribute asleep_lo_attr = __ATTR(asleep_hi, 0660, sysfs_show, NULL);
 struct kobj_attribute asleep_hi_attr = __ATTR(asleep_lo, 0660, sysfs_show, NULL);
+struct kobj_attribute allocs_attr = __ATTR(allocs, 0660, sysfs_show, NULL);
+struct kobj_attribute messages_attr = __ATTR(messages, 0660, sysfs_show, NULL);
+struct kobj_attribute fill_lo_attr = __ATTR(fill_lo, 0660, sysfs_show, NULL);
+struct kobj_attribute fill_hi_attr = __ATTR(fill_hi, 0660, sysfs_show, NULL);
+struct kobj_attribute bytes_attr = __ATTR(bytes, 0660, sysfs_show, NULL);
+struct kobj_attribute expired_lo_attr = __ATTR(expired_lo, 0660, sysfs_show, NULL);
+struct kobj_attribute throttled_attr = __ATTR(throttled, 0660, sysfs_show, NULL);
+struct kobj_attribute commits_attr = __ATTR(commits, 0660, sysfs_show, NULL);
 
 struct kobj_attribute katr_enabled = __ATTR(enabled, 0660, sysfs_show, sysfs_store);
 struct kobj_attribute katr_timeout = __ATTR(timeout, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_timeout_us = __ATTR(timeout_us, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_busy_poll = __ATTR(busy_poll, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_ttl = __ATTR(ttl, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_max_bytes = __ATTR(max_bytes, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_block_size = __ATTR(block_size, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_flush_interval = __ATTR(flush_interval, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_flush_bytes = __ATTR(flush_bytes, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_rate = __ATTR(rate, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_burst = __ATTR(burst, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_flow_rate = __ATTR(flow_rate, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_flow_burst = __ATTR(flow_burst, 0660, sysfs_show, sysfs_store);
 struct kobj_attribute katr_block = __ATTR(block, 0660, sysfs_show, sysfs_store);
 struct kobj_attribute katr_priority = __ATTR(priority, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_backend = __ATTR(backend, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_lockless = __ATTR(lockless, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_datagram = __ATTR(datagram, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_partial = __ATTR(partial, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_broadcast = __ATTR(broadcast, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_group = __ATTR(group, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_levels = __ATTR(levels, 0660, sysfs_show, sysfs_store);
+struct kobj_attribute katr_read_mode = __ATTR(read_mode, 0660, sysfs_show, sysfs_store);
 
 int init_module(void) {
 	int i;
@@ -584,6 +3775,16 @@ int init_module(void) {
 
 	printk("%s: Inserting module HLM\n", MODNAME);
 
+	if(block_max_size <= 0 || block_max_size > BLOCK_SIZE_MAX) {
+		printk(KERN_ERR "%s: block_max_size must be between 1 and %d\n", MODNAME, BLOCK_SIZE_MAX);
+		return -EINVAL;
+	}
+
+	if(create_block_caches()) {
+		printk(KERN_ERR "%s: block cache creation failed\n", MODNAME);
+		return -ENOMEM;
+	}
+
 	hlm_kobject = kobject_create_and_add("hlm",NULL);
 	
 	//Setup all devices
@@ -592,27 +3793,88 @@ int init_module(void) {
 
 		sprintf(name, "%d", i);
 
-		for(int j = 0; j < 2; j++) {
+		for(int j = 0; j < FLOWS; j++) {
 			obj->valid[j] = 0;
+			obj->max_bytes[j] = max_bytes;
+			obj->block_size[j] = block_max_size;
 			obj->r_pos[j] = 0;
 			
 			obj->head[j] = NULL;
 			obj->tail[j] = NULL;
+			obj->block_bytes[j] = 0;
+			obj->block_space[j] = 0;
+
+			obj->ring[j].buf = NULL;
+			obj->ring[j].size = 0;
 
 			mutex_init(&(obj->mux_lock[j]));
-		}
 
+			init_flow_queue(&(obj->wq_w[j]), obj, j, 1);
+			init_flow_queue(&(obj->wq_r[j]), obj, j, 0);
+
+			init_llist_head(&obj->hi_list[j]);
+			atomic_long_set(&obj->hi_pushed[j], 0);
+			obj->base[j] = 0;
+			atomic_long_set(&obj->claimed[j], 0);
+			//Higher levels get more reads in a round
+			obj->weight[j] = j + 1;
+			obj->bucket[j].rate = 0;
+			obj->bucket[j].burst = 0;
+			obj->bucket[j].tokens = 0;
+			obj->bucket[j].last = 0;
+			atomic_long_set(&obj->throttled[j], 0);
+		}
 
-		init_waitqueue_head(&(obj->wq_w));
-		init_waitqueue_head(&(obj->wq_r));
 
 		obj->pending = 0;
+		init_llist_head(&obj->lo_list);
+		INIT_WORK(&obj->lo_work, work_handler);
+		obj->flush_interval = 0;
+		obj->flush_bytes = 0;
+		obj->commits = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+		hrtimer_setup(&obj->flush_timer, flush_timer_handler, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+		hrtimer_init(&obj->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		obj->flush_timer.function = flush_timer_handler;
+#endif
+		INIT_DELAYED_WORK(&obj->reap_work, reap_handler);
+		obj->ttl = 0;
+		obj->expired = 0;
+		obj->dev_bucket.rate = 0;
+		obj->dev_bucket.burst = 0;
+		obj->dev_bucket.tokens = 0;
+		obj->dev_bucket.last = 0;
+		spin_lock_init(&(obj->bucket_lock));
+		obj->lockless = 0;
+		atomic_long_set(&obj->allocs, 0);
+		atomic_long_set(&obj->messages, 0);
 		obj->enabled = 1;
-		obj->timeout = 1000;
+		obj->timeout = div_u64(jiffies_to_nsecs(1000), NSEC_PER_USEC);
+		obj->busy_poll = 0;
 		obj->block = 0;
 		obj->priority = 1;
+		obj->levels = 2;
+		obj->read_mode = READ_FLOW;
+		spin_lock_init(&(obj->rr_lock));
+		obj->rr_level = 1;
+		obj->rr_left = obj->weight[1];
+		obj->backend = BACKEND_LIST;
+		obj->datagram = 0;
+		obj->partial = 0;
+		obj->broadcast = 0;
+		INIT_LIST_HEAD(&obj->subscribers);
+		obj->group = 0;
+		obj->shm = NULL;
+		obj->shm_size = 0;
+		mutex_init(&(obj->shm_lock));
+
+		if(backend == BACKEND_RING && set_backend(obj, BACKEND_RING)) {
+			printk(KERN_ERR "%s: ring allocation failed for device %d\n", MODNAME, i);
+		}
 
-		obj->work_queue = create_singlethread_workqueue(name);
+		//Devices commit their deferred writes in parallel, each one in order
+		obj->work_queue = alloc_ordered_workqueue("hlm_wq_%d", WQ_MEM_RECLAIM, i);
 		if(obj->work_queue == 0) {
 			printk(KERN_ERR "Work queue creation failed\n");
 			goto remove_dev;
@@ -623,12 +3885,39 @@ int init_module(void) {
 		obj->kobj = kobject_create_and_add(name, hlm_kobject);
 		if(sysfs_create_file(obj->kobj,&katr_enabled.attr) ||
 			sysfs_create_file(obj->kobj,&katr_timeout.attr) ||
+			sysfs_create_file(obj->kobj,&katr_timeout_us.attr) ||
+			sysfs_create_file(obj->kobj,&katr_busy_poll.attr) ||
+			sysfs_create_file(obj->kobj,&katr_ttl.attr) ||
+			sysfs_create_file(obj->kobj,&expired_lo_attr.attr) ||
+			sysfs_create_file(obj->kobj,&katr_rate.attr) ||
+			sysfs_create_file(obj->kobj,&katr_burst.attr) ||
+			sysfs_create_file(obj->kobj,&katr_flow_rate.attr) ||
+			sysfs_create_file(obj->kobj,&katr_flow_burst.attr) ||
+			sysfs_create_file(obj->kobj,&throttled_attr.attr) ||
+			sysfs_create_file(obj->kobj,&katr_flush_interval.attr) ||
+			sysfs_create_file(obj->kobj,&katr_flush_bytes.attr) ||
+			sysfs_create_file(obj->kobj,&commits_attr.attr) ||
+			sysfs_create_file(obj->kobj,&katr_max_bytes.attr) ||
+			sysfs_create_file(obj->kobj,&katr_block_size.attr) ||
 			sysfs_create_file(obj->kobj,&katr_priority.attr) ||
 			sysfs_create_file(obj->kobj,&katr_block.attr) ||
 			sysfs_create_file(obj->kobj,&bytes_lo_attr.attr) ||
 			sysfs_create_file(obj->kobj,&bytes_hi_attr.attr) ||
 			sysfs_create_file(obj->kobj,&asleep_hi_attr.attr) ||
-			sysfs_create_file(obj->kobj,&asleep_lo_attr.attr)) {
+			sysfs_create_file(obj->kobj,&asleep_lo_attr.attr) ||
+			sysfs_create_file(obj->kobj,&allocs_attr.attr) ||
+			sysfs_create_file(obj->kobj,&messages_attr.attr) ||
+			sysfs_create_file(obj->kobj,&katr_backend.attr) ||
+			sysfs_create_file(obj->kobj,&fill_lo_attr.attr) ||
+			sysfs_create_file(obj->kobj,&fill_hi_attr.attr) ||
+			sysfs_create_file(obj->kobj,&katr_lockless.attr) ||
+			sysfs_create_file(obj->kobj,&katr_datagram.attr) ||
+			sysfs_create_file(obj->kobj,&katr_partial.attr) ||
+			sysfs_create_file(obj->kobj,&katr_broadcast.attr) ||
+			sysfs_create_file(obj->kobj,&katr_group.attr) ||
+			sysfs_create_file(obj->kobj,&katr_levels.attr) ||
+			sysfs_create_file(obj->kobj,&katr_read_mode.attr) ||
+			sysfs_create_file(obj->kobj,&bytes_attr.attr)) {
 			
 			printk("%s: error during creation of sysfs files\n", MODNAME);
 		    goto remove_sys;
@@ -645,12 +3934,6 @@ int init_module(void) {
 
 	printk(KERN_INFO "Hlm device registered, it is assigned major number %d\n", Major);
 
-	wq = create_singlethread_workqueue("hlm_wq");
-	if(wq == 0) {
-		printk(KERN_ERR "Work queue creation failed\n");
-		goto remove_dev;
-	}
-
     printk("%s: started\n",MODNAME);
 	return 0;
 
@@ -670,10 +3953,39 @@ remove_sys:
     	kobject_put(obj->kobj);
     	sysfs_remove_file(obj->kobj,&katr_enabled.attr);
 		sysfs_remove_file(obj->kobj,&katr_timeout.attr);
+		sysfs_remove_file(obj->kobj,&katr_timeout_us.attr);
+		sysfs_remove_file(obj->kobj,&katr_busy_poll.attr);
+		sysfs_remove_file(obj->kobj,&katr_ttl.attr);
+		sysfs_remove_file(obj->kobj,&expired_lo_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_rate.attr);
+		sysfs_remove_file(obj->kobj,&katr_burst.attr);
+		sysfs_remove_file(obj->kobj,&katr_flow_rate.attr);
+		sysfs_remove_file(obj->kobj,&katr_flow_burst.attr);
+		sysfs_remove_file(obj->kobj,&throttled_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_flush_interval.attr);
+		sysfs_remove_file(obj->kobj,&katr_flush_bytes.attr);
+		sysfs_remove_file(obj->kobj,&commits_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_max_bytes.attr);
+		sysfs_remove_file(obj->kobj,&katr_block_size.attr);
 		sysfs_remove_file(obj->kobj,&katr_priority.attr);
 		sysfs_remove_file(obj->kobj,&katr_block.attr);
+		sysfs_remove_file(obj->kobj,&allocs_attr.attr);
+		sysfs_remove_file(obj->kobj,&messages_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_backend.attr);
+		sysfs_remove_file(obj->kobj,&fill_lo_attr.attr);
+		sysfs_remove_file(obj->kobj,&fill_hi_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_lockless.attr);
+		sysfs_remove_file(obj->kobj,&katr_datagram.attr);
+		sysfs_remove_file(obj->kobj,&katr_partial.attr);
+		sysfs_remove_file(obj->kobj,&katr_broadcast.attr);
+		sysfs_remove_file(obj->kobj,&katr_group.attr);
+		sysfs_remove_file(obj->kobj,&katr_levels.attr);
+		sysfs_remove_file(obj->kobj,&katr_read_mode.attr);
+		sysfs_remove_file(obj->kobj,&bytes_attr.attr);
     }
 
+    destroy_block_caches();
+
     return -1;
 }
 
@@ -683,12 +3995,21 @@ void cleanup_module(void) {
 
 	for(int i = 0; i < MINORS; i++) {
 		object_state *obj = objects + i;
+		//Writes of an open flush window only have the timer, commit them so that their
+		//blocks are freed with the flow
+		hrtimer_cancel(&obj->flush_timer);
+		queue_work(obj->work_queue, &obj->lo_work);
+		flush_work(&obj->lo_work);
 		flush_workqueue(obj->work_queue);
+		cancel_delayed_work_sync(&obj->reap_work);
 
 		// Empty queue
-		for(int j = 0; j < 2; j++) {
+		for(int j = 0; j < FLOWS; j++) {
+			drain_pushed(obj, j);
 			free_queue(obj->head[j]);
+			kvfree(obj->ring[j].buf);
 		}
+		vfree(obj->shm);
 
 		destroy_workqueue(obj->work_queue);
 	}
@@ -704,9 +4025,38 @@ void cleanup_module(void) {
     	kobject_put(obj->kobj);
     	sysfs_remove_file(obj->kobj,&katr_enabled.attr);
 		sysfs_remove_file(obj->kobj,&katr_timeout.attr);
+		sysfs_remove_file(obj->kobj,&katr_timeout_us.attr);
+		sysfs_remove_file(obj->kobj,&katr_busy_poll.attr);
+		sysfs_remove_file(obj->kobj,&katr_ttl.attr);
+		sysfs_remove_file(obj->kobj,&expired_lo_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_rate.attr);
+		sysfs_remove_file(obj->kobj,&katr_burst.attr);
+		sysfs_remove_file(obj->kobj,&katr_flow_rate.attr);
+		sysfs_remove_file(obj->kobj,&katr_flow_burst.attr);
+		sysfs_remove_file(obj->kobj,&throttled_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_flush_interval.attr);
+		sysfs_remove_file(obj->kobj,&katr_flush_bytes.attr);
+		sysfs_remove_file(obj->kobj,&commits_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_max_bytes.attr);
+		sysfs_remove_file(obj->kobj,&katr_block_size.attr);
 		sysfs_remove_file(obj->kobj,&katr_priority.attr);
 		sysfs_remove_file(obj->kobj,&katr_block.attr);
+		sysfs_remove_file(obj->kobj,&allocs_attr.attr);
+		sysfs_remove_file(obj->kobj,&messages_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_backend.attr);
+		sysfs_remove_file(obj->kobj,&fill_lo_attr.attr);
+		sysfs_remove_file(obj->kobj,&fill_hi_attr.attr);
+		sysfs_remove_file(obj->kobj,&katr_lockless.attr);
+		sysfs_remove_file(obj->kobj,&katr_datagram.attr);
+		sysfs_remove_file(obj->kobj,&katr_partial.attr);
+		sysfs_remove_file(obj->kobj,&katr_broadcast.attr);
+		sysfs_remove_file(obj->kobj,&katr_group.attr);
+		sysfs_remove_file(obj->kobj,&katr_levels.attr);
+		sysfs_remove_file(obj->kobj,&katr_read_mode.attr);
+		sysfs_remove_file(obj->kobj,&bytes_attr.attr);
     }
 
+    destroy_block_caches();
+
     printk("%s: Work queue destroyed\n", MODNAME);
 }
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "lib/ioctl.h"
+
+#define MESSAGES 8
+#define DATA "batch"
+#define SIZE strlen(DATA)
+
+int main(int argc, char** argv){
+        int fd;
+        int ret;
+        char buff[MESSAGES][20];
+        struct hlm_msg msgs[MESSAGES];
+        struct hlm_batch batch;
+
+        fd = open("./test", O_RDWR);
+        if(fd == -1) {
+                printf("open error on device\n");
+                return -1;
+        }
+
+        batch.msgs = msgs;
+        batch.count = MESSAGES;
+
+        //All the messages are queued with a single syscall
+        for(int i = 0; i < MESSAGES; i++) {
+                msgs[i].buff = DATA;
+                msgs[i].len = SIZE;
+        }
+
+        ret = ioctl(fd, SEND_BATCH, &batch);
+        printf("Send batch ret: %d\n", ret);
+        for(int i = 0; i < MESSAGES; i++) {
+                printf("Message %d ret: %ld\n", i, msgs[i].ret);
+        }
+
+        //Every buffer receives the size of a message
+        for(int i = 0; i < MESSAGES; i++) {
+                msgs[i].buff = buff[i];
+                msgs[i].len = SIZE;
+        }
+
+        ret = ioctl(fd, RECV_BATCH, &batch);
+        printf("Receive batch ret: %d\n", ret);
+        for(int i = 0; i < ret; i++) {
+                buff[i][msgs[i].ret] = '\0';
+                printf("Buffer %d ret: %ld ---%s---\n", i, msgs[i].ret, buff[i]);
+        }
+
+        close(fd);
+        return 0;
+}
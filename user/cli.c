@@ -58,7 +58,7 @@ int ioctl_command() {
         int ret;
         int cmd;
 
-        printf("ioctl>> command(timeout, enable, priority, block):  ");
+        printf("ioctl>> command(timeout, timeout_us, busy_poll, enable, priority, block, backend, lockless, datagram, partial, broadcast, group, levels, read_mode, ttl, rate, burst, flush_interval, flush_bytes, max_bytes, block_size):  ");
         scanf("%s", command);
 
         printf("ioctl>> value: ");
@@ -70,8 +70,48 @@ int ioctl_command() {
                 cmd = CHG_ENB_DIS;
         } else if(!strcmp("timeout", command)) {
                 cmd = CHG_TIMEOUT;
+        } else if(!strcmp("timeout_us", command)) {
+                cmd = CHG_TIMEOUT_US;
+        } else if(!strcmp("busy_poll", command)) {
+                cmd = CHG_BUSY_POLL;
         } else if(!strcmp("block", command)) {
                 cmd = CHG_BLK;
+        } else if(!strcmp("backend", command)) {
+                cmd = CHG_BACKEND;
+        } else if(!strcmp("lockless", command)) {
+                cmd = CHG_LOCKLESS;
+        } else if(!strcmp("datagram", command)) {
+                cmd = CHG_DATAGRAM;
+        } else if(!strcmp("partial", command)) {
+                cmd = CHG_PARTIAL;
+        } else if(!strcmp("broadcast", command)) {
+                cmd = CHG_BROADCAST;
+        } else if(!strcmp("group", command)) {
+                cmd = CHG_GROUP;
+        } else if(!strcmp("levels", command)) {
+                cmd = CHG_LEVELS;
+        } else if(!strcmp("read_mode", command)) {
+                cmd = CHG_READ_MODE;
+        } else if(!strcmp("ttl", command)) {
+                cmd = CHG_TTL;
+        } else if(!strcmp("flush_interval", command)) {
+                cmd = CHG_FLUSH_INTERVAL;
+        } else if(!strcmp("flush_bytes", command)) {
+                cmd = CHG_FLUSH_BYTES;
+        } else if(!strcmp("max_bytes", command)) {
+                //Size of all the levels, HLM_SIZE sets the one of a level
+                cmd = CHG_MAX_BYTES;
+                value = HLM_SIZE(HLM_DEVICE, value);
+        } else if(!strcmp("block_size", command)) {
+                cmd = CHG_BLOCK_SIZE;
+                value = HLM_SIZE(HLM_DEVICE, value);
+        } else if(!strcmp("rate", command)) {
+                //Limit of the whole device in KiB, HLM_LIMIT sets the one of a level
+                cmd = CHG_RATE;
+                value = HLM_LIMIT(HLM_DEVICE, value);
+        } else if(!strcmp("burst", command)) {
+                cmd = CHG_BURST;
+                value = HLM_LIMIT(HLM_DEVICE, value);
         } else {
                 printf("Invalid command\n");
                 return -1;
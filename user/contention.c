@@ -0,0 +1,146 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "lib/ioctl.h"
+
+#define DATA "record"
+#define SIZE strlen(DATA)
+#define WRITERS 10
+#define SECONDS 5
+#define READ_SIZE 400
+
+// Writers hammer the flow while a reader copies in buffers that always page fault,
+// compare the writer throughput before and after a change of the read path
+
+volatile int running = 1;
+int priority;
+long writes[WRITERS];
+double write_time[WRITERS];
+
+// Settings are per open file, every thread applies them to its own
+int open_device() {
+        int fd;
+        int number;
+
+        fd = open("./test", O_RDWR);
+        if(fd == -1) {
+                printf("open error on device\n");
+                return -1;
+        }
+
+        ioctl(fd,CHG_PRT,(int32_t*) &priority);
+
+        number = 0;
+        ioctl(fd,CHG_BLK,(int32_t*) &number);
+
+        return fd;
+}
+
+double now() {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void * write_thread(void* arg){
+        int fd;
+        int id;
+        double start;
+
+        id = (long)arg;
+
+        fd = open_device();
+        if(fd == -1) {
+                return NULL;
+        }
+
+        while(running) {
+                start = now();
+                if(write(fd, DATA, SIZE) > 0) {
+                        write_time[id] += now() - start;
+                        writes[id]++;
+                }
+        }
+
+        close(fd);
+        return NULL;
+}
+
+void * read_thread(void* arg){
+        int fd;
+        long reads;
+        char *buff;
+
+        fd = open_device();
+        if(fd == -1) {
+                return NULL;
+        }
+
+        buff = mmap(NULL, READ_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        reads = 0;
+
+        while(running) {
+                //Drop the page so that every copy to user faults
+                madvise(buff, READ_SIZE, MADV_DONTNEED);
+                if(read(fd, buff, READ_SIZE) > 0) {
+                        reads++;
+                }
+        }
+
+        printf("Reads: %ld\n", reads);
+
+        munmap(buff, READ_SIZE);
+        close(fd);
+        return NULL;
+}
+
+int main(int argc, char** argv){
+        int fd;
+        long total;
+        double time;
+        pthread_t reader;
+        pthread_t tid[WRITERS];
+
+        fd = open("./test", O_RDWR);
+        if(fd == -1) {
+                printf("open error on device\n");
+                return -1;
+        }
+
+        priority = argc > 1 ? atoi(argv[1]) : 1;
+
+        pthread_create(&reader,NULL,read_thread,NULL);
+        for(long i=0;i<WRITERS;i++) {
+                pthread_create(&tid[i],NULL,write_thread,(void*)i);
+        }
+
+        sleep(SECONDS);
+        running = 0;
+
+        for(int i=0;i<WRITERS;i++) {
+                pthread_join(tid[i],NULL);
+        }
+        pthread_join(reader,NULL);
+
+        total = 0;
+        time = 0;
+        for(int i=0;i<WRITERS;i++) {
+                total += writes[i];
+                time += write_time[i];
+        }
+
+        printf("Writes: %ld (%lf per second)\n", total, (double)total / SECONDS);
+        if(total > 0) {
+                printf("Average write latency: %lf us\n", time / total * 1e6);
+        }
+
+        close(fd);
+        return 0;
+}
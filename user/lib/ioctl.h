@@ -2,3 +2,99 @@
 #define CHG_ENB_DIS 1
 #define CHG_TIMEOUT 4
 #define CHG_BLK 3
+#define CHG_BACKEND 5
+#define CHG_LOCKLESS 6
+#define SHM_NOTIFY 7
+#define SHM_WAIT 8
+#define SEND_BATCH 9
+#define RECV_BATCH 10
+#define CHG_DATAGRAM 11
+#define CHG_BROADCAST 12
+#define CHG_GROUP 13
+#define CHG_LEVELS 14
+#define CHG_READ_MODE 15
+#define CHG_WEIGHT 16
+#define CHG_TIMEOUT_US 17
+#define CHG_BUSY_POLL 18
+#define CHG_TTL 19
+#define CHG_RATE 20
+#define CHG_BURST 21
+#define CHG_FLUSH_INTERVAL 22
+#define CHG_FLUSH_BYTES 23
+#define CHG_MAX_BYTES 24
+#define CHG_BLOCK_SIZE 25
+#define CHG_PARTIAL 26
+
+//CHG_TIMEOUT takes jiffies, CHG_TIMEOUT_US microseconds. CHG_BUSY_POLL sets how many
+//microseconds a blocking call may spin before sleeping, 0 disables it. The spin window
+//adapts to how long the waits of the file last, up to this limit
+
+//CHG_TTL sets in milliseconds how long the low priority data can wait for a reader
+//before being dropped, 0 keeps it until it is read
+
+//CHG_FLUSH_INTERVAL sets in microseconds how long the low priority writes are collected
+//before being committed together, 0 commits them right away. CHG_FLUSH_BYTES commits them
+//before the end of the window once that many bytes are pending, 0 for no threshold
+
+//Values of CHG_READ_MODE: read the flow of CHG_PRT, the highest level with data,
+//weighted round robin between the levels with data, or fill a single read from all
+//the levels starting from the highest one, waiting on all of them
+#define READ_FLOW 0
+#define READ_STRICT 1
+#define READ_WRR 2
+#define READ_COMBINED 3
+
+//Value of CHG_WEIGHT, the number of reads served by a level in a round
+#define HLM_WEIGHT(level, weight) (((level) << 8) | (weight))
+
+//Value of CHG_RATE and CHG_BURST, the KiB per second or the KiB of burst allowed to the
+//writes of a level, or of the whole device with HLM_DEVICE as level. A rate of 0 removes
+//the limit, a burst of 0 allows a second of rate
+#define HLM_DEVICE 127
+#define HLM_LIMIT(level, kib) (((level) << 24) | (kib))
+
+//Value of CHG_MAX_BYTES and CHG_BLOCK_SIZE, the capacity or the size of the blocks in
+//bytes of a level, or of all the levels with HLM_DEVICE as level. Sizes are below 16 MiB,
+//block sizes up to 2048 bytes
+#define HLM_SIZE(level, bytes) (((level) << 24) | (bytes))
+
+//Flag of SHM_WAIT to sleep until there is space instead of data
+#define SHM_WAIT_SPACE 2
+
+//Control page at the start of the mapping of a device, followed by the data of
+//the 2 rings. Indexes only grow, byte i of a flow is at offset + i % size.
+//The producer writes at head and the consumer reads from tail up to commit.
+//High priority producers move commit along with head, low priority bytes are
+//committed by the deferred work of the device after SHM_NOTIFY.
+//head - tail can't exceed capacity, SHM_NOTIFY wakes the threads sleeping in
+//SHM_WAIT or poll after head or tail are moved.
+//The rings have a budget of their own: capacity follows max_bytes of levels 0
+//and 1 up to the size of the ring at the first mmap, and the bytes in a ring are
+//not counted in the flow read and written with read() and write()
+struct hlm_shm_flow {
+	unsigned long long head;
+	unsigned long long commit;
+	unsigned long long tail;
+	unsigned long long size;
+	unsigned long long offset;
+	unsigned long long capacity;
+};
+
+struct hlm_shm {
+	struct hlm_shm_flow flow[2];
+};
+
+//A message of SEND_BATCH or RECV_BATCH, ret is set to the bytes sent or received
+//or to a negative error
+struct hlm_msg {
+	void *buff;
+	unsigned long len;
+	long ret;
+};
+
+//Argument of SEND_BATCH and RECV_BATCH, at most 64 messages. SEND_BATCH returns the
+//number of messages queued, RECV_BATCH the number of buffers filled
+struct hlm_batch {
+	struct hlm_msg *msgs;
+	unsigned int count;
+};
@@ -0,0 +1,99 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "lib/ioctl.h"
+
+#define DATA "abcdef"
+#define SIZE strlen(DATA)
+//Control page and the 2 rings with the default max_bytes
+#define MAP_SIZE (4096 * 3)
+
+// Copy len bytes in the shared ring of a flow, returns 0 if there is no space
+int shm_write(char *map, struct hlm_shm_flow *flow, const char *buff, int len) {
+        unsigned long long head;
+        unsigned long long tail;
+
+        head = flow->head;
+        tail = __atomic_load_n(&flow->tail, __ATOMIC_ACQUIRE);
+        if(head - tail + len > flow->capacity) {
+                return 0;
+        }
+
+        for(int i = 0; i < len; i++) {
+                map[flow->offset + (head + i) % flow->size] = buff[i];
+        }
+
+        __atomic_store_n(&flow->head, head + len, __ATOMIC_RELEASE);
+        return len;
+}
+
+// Copy up to len committed bytes from the shared ring of a flow
+int shm_read(char *map, struct hlm_shm_flow *flow, char *buff, int len) {
+        unsigned long long commit;
+        unsigned long long tail;
+        int n;
+
+        tail = flow->tail;
+        commit = __atomic_load_n(&flow->commit, __ATOMIC_ACQUIRE);
+        n = commit - tail < len ? commit - tail : len;
+
+        for(int i = 0; i < n; i++) {
+                buff[i] = map[flow->offset + (tail + i) % flow->size];
+        }
+
+        __atomic_store_n(&flow->tail, tail + n, __ATOMIC_RELEASE);
+        return n;
+}
+
+int main(int argc, char** argv){
+        int fd;
+        int ret;
+        int prt;
+        char *map;
+        char buff[20] = "";
+        struct hlm_shm *shm;
+        struct hlm_shm_flow *flow;
+
+        fd = open("./test", O_RDWR);
+        if(fd == -1) {
+                printf("open error on device\n");
+                return -1;
+        }
+
+        map = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED) {
+                printf("mmap error on device\n");
+                return -1;
+        }
+
+        shm = (struct hlm_shm *)map;
+
+        for(prt = 0; prt < 2; prt++) {
+                flow = &shm->flow[prt];
+
+                ret = shm_write(map, flow, DATA, SIZE);
+                if(prt) {
+                        //High priority bytes are readable right away
+                        __atomic_store_n(&flow->commit, flow->head, __ATOMIC_RELEASE);
+                }
+                printf("Shared write prt %d ret: %d\n", prt, ret);
+
+                //Wake sleeping consumers, low priority bytes get committed
+                ioctl(fd, SHM_NOTIFY, (int32_t*) &prt);
+                ioctl(fd, SHM_WAIT, (int32_t*) &prt);
+
+                ret = shm_read(map, flow, buff, sizeof(buff) - 1);
+                buff[ret] = '\0';
+                printf("Shared read prt %d ret: %d ---%s---\n", prt, ret, buff);
+
+                //Wake sleeping producers
+                ioctl(fd, SHM_NOTIFY, (int32_t*) &prt);
+        }
+
+        munmap(map, MAP_SIZE);
+        return 0;
+}
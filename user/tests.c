@@ -16,6 +16,7 @@ void * the_thread(void* path){
         int ret;
         char* device;
         int fd;
+        int number;
         char buff[50];
         pthread_t self;
 
@@ -27,6 +28,10 @@ void * the_thread(void* path){
                 return NULL;
         }
 
+        //Priority is a setting of the open file
+        number = 0;
+        ioctl(fd,CHG_PRT,(int32_t*) &number);
+
 	self = pthread_self();
         sprintf(buff, "thread\n", self);
 
@@ -42,6 +47,7 @@ void * read_thread(void* path){
         int ret;
         char* device;
         int fd;
+        int number;
         char buff[50];
         pthread_t self;
 
@@ -53,6 +59,10 @@ void * read_thread(void* path){
                 return NULL;
         }
 
+        //Priority is a setting of the open file
+        number = 0;
+        ioctl(fd,CHG_PRT,(int32_t*) &number);
+
         self = pthread_self();
 
         for(int i=0;i<100;i++) {
@@ -16,25 +16,55 @@
 #define EXECUTIONS 1000
 #define TESTS 200
 
+// Level measured by main, settings are per open file and the threads apply it to their own
+volatile int priority;
+
+// Open the device non-blocking like the fd of main
+int open_device(char *device) {
+        int fd;
+        int number;
+
+        fd = open(device,O_RDWR);
+        if(fd == -1) {
+                printf("open error on device %s\n",device);
+                return -1;
+        }
+
+        number = 0;
+        ioctl(fd,CHG_BLK,(int32_t*) &number);
+
+        return fd;
+}
+
+// Follow the level measured by main
+void follow_priority(int fd, int *level) {
+        if(*level != priority) {
+                *level = priority;
+                ioctl(fd,CHG_PRT,(int32_t*) level);
+        }
+}
+
 void * the_thread(void* path){
         int ret;
         char* device;
         int fd;
+        int level;
         char buff[50];
         pthread_t self;
 
         device = (char*)path;
 
-        fd = open(device,O_RDWR);
+        fd = open_device(device);
         if(fd == -1) {
-                printf("open error on device %s\n",device);
                 return NULL;
         }
+        level = -1;
 
 	self = pthread_self();
         sprintf(buff, "thread\n", self);
 
         while(1) {
+                follow_priority(fd, &level);
         	ret = write(fd,buff,strlen(buff));
         	sleep(1);
      	}
@@ -45,20 +75,22 @@ void * read_thread(void* path){
         int ret;
         char* device;
         int fd;
+        int level;
         char buff[50];
         pthread_t self;
 
         device = (char*)path;
 
-        fd = open(device,O_RDWR);
+        fd = open_device(device);
         if(fd == -1) {
-                printf("open error on device %s\n",device);
                 return NULL;
         }
+        level = -1;
 
         self = pthread_self();
 
         while(1) {
+                follow_priority(fd, &level);
                 ret = read(fd, buff, 7);
                 sleep(1);
         }
@@ -154,6 +186,7 @@ int main(int argc, char** argv){
         for(int prt = 0; prt < 2; prt ++) {
                 number = prt;
                 ioctl(fd,CHG_PRT,(int32_t*) &number);
+                priority = prt;
                 sleep(5);
 
                for(int i = 0; i < TESTS; i++) {
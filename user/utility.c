@@ -5,8 +5,35 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "lib/ioctl.h"
 
+//Write a setting of the device in its sysfs attribute
+int set_default(int fd, char *name, char *value) {
+	char attr[64];
+	struct stat st;
+	FILE *file;
+
+	if(fstat(fd, &st) == -1) {
+		printf("stat error on device\n");
+		return -1;
+	}
+
+	sprintf(attr, "/sys/hlm/%d/%s", minor(st.st_rdev), name);
+	file = fopen(attr, "w");
+	if(file == NULL) {
+		printf("open error on %s\n", attr);
+		return -1;
+	}
+
+	fprintf(file, "%s", value);
+	fclose(file);
+
+	printf("Changed %s: %s\n", name, value);
+	return 0;
+}
+
 int main(int argc, char** argv){
 	char *path;
 	char *command;
@@ -25,7 +52,7 @@ int main(int argc, char** argv){
 	value = argv[3];
 
 	if(!strcmp("help", path)) {
-		printf("Command list\nhelp: display commands\npriority <value> : change priority of node\nenabled <value>: enable and disable node\n");
+		printf("Command list\nhelp: display commands\npriority <value> : change default priority of node\ntimeout <value>: change default timeout of node\ntimeout_us <value>: change default timeout of node in microseconds\nbusy_poll <value>: change default busy poll limit of node in microseconds\nblock <value>: change default blocking behaviour of node\nenabled <value>: enable and disable node\nbackend <value>: 0 list of blocks, 1 contiguous ring\nlockless <value>: lockless high priority writes\ndatagram <value>: every write is a record read whole\npartial <value>: writes store the bytes that fit and return a short count\nbroadcast <value>: every open file reads all the data\ngroup <value>: readers claim distinct records, needs datagram\nlevels <value>: number of priority levels\nread_mode <value>: 0 single flow, 1 strict priority, 2 weighted round robin, 3 combined\nttl <value>: milliseconds before low priority data expires, 0 never\nflush_interval <value>: microseconds low priority writes are collected before the commit\nflush_bytes <value>: pending bytes that commit before the end of the interval\nrate <value>: bytes per second written to the node, 0 no limit\nburst <value>: bytes written at once over the rate\nflow_rate \"<level> <value>\": bytes per second written to a level\nflow_burst \"<level> <value>\": bytes written at once over the rate of a level\nmax_bytes \"[level] <value>\": bytes stored in all the levels or in one\nblock_size \"[level] <value>\": size of the blocks of the writes to all the levels or to one\n");
 		return 0;
 	}
 
@@ -35,19 +62,56 @@ int main(int argc, char** argv){
             return -1;
     }
 
+	//Priority, timeout, busy poll and blocking behaviour set with ioctl last only as long
+	//as the file, change the defaults of the device instead
+	if(!strcmp("priority", command) || !strcmp("timeout", command) || !strcmp("timeout_us", command) ||
+		!strcmp("busy_poll", command) || !strcmp("block", command)) {
+		return set_default(fd, command, value);
+	}
+
+	//Rate limits and sizes are set in bytes through sysfs, the ones of a level take the level first
+	if(!strcmp("rate", command) || !strcmp("burst", command) || !strcmp("flow_rate", command) ||
+		!strcmp("flow_burst", command) || !strcmp("max_bytes", command) || !strcmp("block_size", command)) {
+		return set_default(fd, command, value);
+	}
+
     val = atoi(value);
-	if(!strcmp("priority", command)) {
-		cmd = CHG_PRT;
-		printf("Changing priority: %d\n", val);
-	} else if(!strcmp("enable", command)) {
+	if(!strcmp("enable", command)) {
 		cmd = CHG_ENB_DIS;
 		printf("Changing enabled state: %d\n", val);
-	} else if(!strcmp("timeout", command)) {
-		cmd = CHG_TIMEOUT;
-		printf("Changing timeout: %d\n", val);
-	} else if(!strcmp("block", command)) {
-		cmd = CHG_BLK;
-		printf("Changing block state: %d\n", val);
+	} else if(!strcmp("backend", command)) {
+		cmd = CHG_BACKEND;
+		printf("Changing backend: %d\n", val);
+	} else if(!strcmp("lockless", command)) {
+		cmd = CHG_LOCKLESS;
+		printf("Changing lockless high priority writes: %d\n", val);
+	} else if(!strcmp("datagram", command)) {
+		cmd = CHG_DATAGRAM;
+		printf("Changing datagram mode: %d\n", val);
+	} else if(!strcmp("partial", command)) {
+		cmd = CHG_PARTIAL;
+		printf("Changing partial writes: %d\n", val);
+	} else if(!strcmp("broadcast", command)) {
+		cmd = CHG_BROADCAST;
+		printf("Changing broadcast mode: %d\n", val);
+	} else if(!strcmp("group", command)) {
+		cmd = CHG_GROUP;
+		printf("Changing consumer group mode: %d\n", val);
+	} else if(!strcmp("levels", command)) {
+		cmd = CHG_LEVELS;
+		printf("Changing priority levels: %d\n", val);
+	} else if(!strcmp("read_mode", command)) {
+		cmd = CHG_READ_MODE;
+		printf("Changing read mode: %d\n", val);
+	} else if(!strcmp("ttl", command)) {
+		cmd = CHG_TTL;
+		printf("Changing ttl: %d\n", val);
+	} else if(!strcmp("flush_interval", command)) {
+		cmd = CHG_FLUSH_INTERVAL;
+		printf("Changing flush interval: %d\n", val);
+	} else if(!strcmp("flush_bytes", command)) {
+		cmd = CHG_FLUSH_BYTES;
+		printf("Changing flush bytes: %d\n", val);
 	} else {
 		printf("Invalid command\n");
 		return 0;